@@ -59,11 +59,13 @@ See video: https://youtu.be/tgamhuQnOkM
 
 #include <list>
 #include <iostream>
+#include <iomanip>
 #include <algorithm>
+#include <memory>
 using namespace std;
 
 #define FTYPE double
-#include "olcNoiseMaker.h"
+#include "olcNoiseMaker_VIDEO_PARTS_3_4.h"
 
 
 namespace synth
@@ -77,29 +79,6 @@ namespace synth
 		return dHertz * 2.0 * PI;
 	}
 
-	struct instrument_base;
-
-	// A basic note
-	struct note
-	{
-		int id;		// Position in scale
-		FTYPE on;	// Time note was activated
-		FTYPE off;	// Time note was deactivated
-		bool active;
-		instrument_base *channel;
-
-		note()
-		{
-			id = 0;
-			on = 0.0;
-			off = 0.0;
-			active = false;
-			channel = nullptr;
-		}
-
-		//bool operator==(const note& n1, const note& n2) { return n1.id == n2.id; }
-	};
-
 	//////////////////////////////////////////////////////////////////////////////
 	// Multi-Function Oscillator
 	const int OSC_SINE = 0;
@@ -108,12 +87,14 @@ namespace synth
 	const int OSC_SAW_ANA = 3;
 	const int OSC_SAW_DIG = 4;
 	const int OSC_NOISE = 5;
+	const int OSC_NOISE_PINK = 6;	// Pink and brown noise need an oscillator, see struct noise
+	const int OSC_NOISE_BROWN = 7;
 
-	FTYPE osc(const FTYPE dTime, const FTYPE dHertz, const int nType = OSC_SINE,
-		const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0, FTYPE dCustom = 50.0)
+	// The shape of each waveform. dPhase is how far through the cycle it is
+	// (0.0 to 1.0), dMod is extra phase in radians from the LFO.
+	FTYPE wave(const int nType, const FTYPE dPhase, const FTYPE dMod, const FTYPE dCustom, const FTYPE dTime)
 	{
-
-		FTYPE dFreq = w(dHertz) * dTime + dLFOAmplitude * dHertz * (sin(w(dLFOHertz) * dTime));
+		FTYPE dFreq = 2.0 * PI * dPhase + dMod;
 
 		switch (nType)
 		{
@@ -128,435 +109,2764 @@ namespace synth
 
 		case OSC_SAW_ANA: // Saw wave (analogue / warm / slow)
 		{
+			// sin(n*x) for each harmonic from the two before it, only two sins needed
 			FTYPE dOutput = 0.0;
+			FTYPE dSin = sin(dFreq), dCos2 = 2.0 * cos(dFreq);
+			FTYPE dLast = 0.0, dThis = dSin;
 			for (FTYPE n = 1.0; n < dCustom; n++)
-				dOutput += (sin(n*dFreq)) / n;
+			{
+				dOutput += dThis / n;
+				FTYPE dNext = dCos2 * dThis - dLast;
+				dLast = dThis;
+				dThis = dNext;
+			}
 			return dOutput * (2.0 / PI);
 		}
 
 		case OSC_SAW_DIG:
-			return (2.0 / PI) * (dHertz * PI * fmod(dTime, 1.0 / dHertz) - (PI / 2.0));
+			return 2.0 * dPhase - 1.0;
 
-		case OSC_NOISE:
-			return 2.0 * ((FTYPE)rand() / (FTYPE)RAND_MAX) - 1.0;
+		case OSC_NOISE: // Worked out from the time, so it can be played again exactly
+		{
+			double d = dTime;
+			uint64_t n;
+			memcpy(&n, &d, sizeof(n));
+			return 2.0 * ((FTYPE)olcHash32((uint32_t)n ^ olcHash32((uint32_t)(n >> 32))) / 4294967295.0) - 1.0;
+		}
 
 		default:
 			return 0.0;
 		}
 	}
 
-	//////////////////////////////////////////////////////////////////////////////
-	// Scale to Frequency conversion
+	// Works everything out from the time alone. Kept for code that has no
+	// oscillator of its own, an oscillator is cheaper and more accurate.
+	FTYPE osc(const FTYPE dTime, const FTYPE dHertz, const int nType = OSC_SINE,
+		const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0, FTYPE dCustom = 50.0)
+	{
+		FTYPE dCycles = dHertz * dTime;
+		FTYPE dMod = dLFOAmplitude * dHertz * (sin(w(dLFOHertz) * dTime));
+		return wave(nType, dCycles - floor(dCycles), dMod, dCustom, dTime);
+	}
 
-	const int SCALE_DEFAULT = 0;
+	// Band limited edges worked out with polynomials, with no sin or table
+	// needed. A jump in the wave, or a sudden change in its slope, is
+	// smoothed over the samples either side of it, which takes out most of
+	// the aliasing. dStep is how much of a cycle passes each sample.
 
-	FTYPE scale(const int nNoteID, const int nScaleID = SCALE_DEFAULT)
+	// What to add to a jump of +1 at phase 0, dPhase samples away from it
+	FTYPE blep(FTYPE dPhase, const FTYPE dStep)
 	{
-		switch (nScaleID)
+		if (dPhase < dStep)
 		{
-		case SCALE_DEFAULT: default:
-			return 8 * pow(1.0594630943592952645618252949463, nNoteID);
-		}		
+			FTYPE x = dPhase / dStep - 1.0;
+			return -0.5 * x * x;
+		}
+		if (dPhase > 1.0 - dStep)
+		{
+			FTYPE x = (dPhase - 1.0) / dStep + 1.0;
+			return 0.5 * x * x;
+		}
+		return 0.0;
 	}
 
-
-	//////////////////////////////////////////////////////////////////////////////
-	// Envelopes
-
-	struct envelope
+	// What to add to a change in slope of +1 a sample at phase 0
+	FTYPE blamp(FTYPE dPhase, const FTYPE dStep)
 	{
-		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) = 0;
-	};
+		FTYPE x;
+		if (dPhase < dStep)
+			x = 1.0 - dPhase / dStep;
+		else if (dPhase > 1.0 - dStep)
+			x = 1.0 - (1.0 - dPhase) / dStep;
+		else
+			return 0.0;
+		return x * x * x * (1.0 / 6.0);
+	}
 
-	struct envelope_adsr : public envelope
+	// Square, triangle and digital saw, in step with wave() but without its
+	// aliasing. Other waveforms are left to wave().
+	FTYPE wave_blep(const int nType, const FTYPE dPhase, const FTYPE dStep)
 	{
-		FTYPE dAttackTime;
-		FTYPE dDecayTime;
-		FTYPE dSustainAmplitude;
-		FTYPE dReleaseTime;
-		FTYPE dStartAmplitude;
+		FTYPE dt = fmin(fabs(dStep), 0.5);
+		FTYPE dHalf = dPhase < 0.5 ? dPhase + 0.5 : dPhase - 0.5;
 
-		envelope_adsr()
+		switch (nType)
 		{
-			dAttackTime = 0.1;
-			dDecayTime = 0.1;
-			dSustainAmplitude = 1.0;
-			dReleaseTime = 0.2;
-			dStartAmplitude = 1.0;
-		}
+		case OSC_SQUARE: // Up 2 at the start of the cycle, down 2 half way
+			return (dPhase < 0.5 ? 1.0 : -1.0) + 2.0 * (blep(dPhase, dt) - blep(dHalf, dt));
 
-		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff)
+		case OSC_TRIANGLE: // Turns down at a quarter, and up at three quarters
 		{
-			FTYPE dAmplitude = 0.0;
-			FTYPE dReleaseAmplitude = 0.0;
+			FTYPE dQuarter = dPhase < 0.75 ? dPhase + 0.25 : dPhase - 0.75;
+			FTYPE dThree = dQuarter < 0.5 ? dQuarter + 0.5 : dQuarter - 0.5;
+			FTYPE dNaive = dQuarter < 0.5 ? 4.0 * dQuarter - 1.0 : 3.0 - 4.0 * dQuarter;
+			return dNaive + 8.0 * dt * (blamp(dQuarter, dt) - blamp(dThree, dt));
+		}
 
-			if (dTimeOn > dTimeOff) // Note is on
-			{
-				FTYPE dLifeTime = dTime - dTimeOn;
+		case OSC_SAW_DIG: // Down 2 at the end of each cycle
+			return 2.0 * dPhase - 1.0 - 2.0 * blep(dPhase, dt);
 
-				if (dLifeTime <= dAttackTime)
-					dAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+		default:
+			return 0.0;
+		}
+	}
 
-				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
-					dAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+	//////////////////////////////////////////////////////////////////////////////
+	// Noise
+
+	// Noise for one voice, from its own seed. White and pink noise are worked
+	// out from the seed and the sample's position alone, so can start from
+	// anywhere. Brown noise is white noise smoothed by a filter, and remembers
+	// what came before; but it forgets anything more than BROWN_MEMORY samples
+	// back, so it can be picked up anywhere by running the filter over those.
+	struct noise
+	{
+		static const int PINK_ROWS = 12;	// The slowest changes every 8192 samples
+		static const int BROWN_MEMORY = 2048;
 
-				if (dLifeTime > (dAttackTime + dDecayTime))
-					dAmplitude = dSustainAmplitude;
-			}
-			else // Note is off
+		uint32_t nSeed = 0;
+		uint64_t nSample = 0;	// Position of the next sample
+		uint64_t nBrownAt = 0;	// Position dBrown is ready for
+		FTYPE dBrown = 0.0;
+
+		// Carry on from position nPosition
+		void Seek(uint64_t nPosition)
+		{
+			nSample = nPosition;
+		}
+
+		// Pink noise the Voss-McCartney way, adding rows of white noise that
+		// each hold a value for twice as long as the row before
+		static FTYPE pink(uint32_t nSeed, uint64_t nPosition)
+		{
+			FTYPE d = olcRandom(nSeed, nPosition);
+			for (int k = 0; k < PINK_ROWS; k++)
+				d += olcRandom(row(nSeed, k), nPosition >> (k + 1));
+			return d * (1.0 / (FTYPE)(PINK_ROWS + 1));
+		}
+
+		FTYPE operator()(const int nType)
+		{
+			FTYPE d;
+			switch (nType)
 			{
-				FTYPE dLifeTime = dTimeOff - dTimeOn;
+			case OSC_NOISE_PINK:
+				d = pink(nSeed, nSample);
+				break;
 
-				if (dLifeTime <= dAttackTime)
-					dReleaseAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+			case OSC_NOISE_BROWN:
+				if (nBrownAt != nSample)
+				{
+					// Somewhere new, run the filter up to it from silence
+					nBrownAt = nSample > BROWN_MEMORY ? nSample - BROWN_MEMORY : 0;
+					dBrown = 0.0;
+					while (nBrownAt < nSample)
+						brown(nBrownAt++);
+				}
+				d = brown(nSample);
+				nBrownAt = nSample + 1;
+				break;
 
-				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
-					dReleaseAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+			default:
+				d = olcRandom(nSeed, nSample);
+				break;
+			}
+			nSample++;
+			return d;
+		}
 
-				if (dLifeTime > (dAttackTime + dDecayTime))
-					dReleaseAmplitude = dSustainAmplitude;
+		// nSamples at once into pOut. White and pink noise are made a run at a
+		// time, the same numbers as one sample at a time.
+		void Fill(const int nType, FTYPE *pOut, size_t nSamples)
+		{
+			if (nType == OSC_NOISE_BROWN)
+			{
+				for (size_t i = 0; i < nSamples; i++)
+					pOut[i] = (*this)(nType);
+				return;
+			}
 
-				dAmplitude = ((dTime - dTimeOff) / dReleaseTime) * (0.0 - dReleaseAmplitude) + dReleaseAmplitude;
+			olcRandomBlock(nSeed, nSample, pOut, nSamples);
+			if (nType == OSC_NOISE_PINK && nSamples > 0)
+			{
+				// Keep a running total of the rows, and only change the ones
+				// that move on. Every value is a multiple of 2^-31, so the
+				// total is exact and matches pink() to the last bit.
+				FTYPE dRows[PINK_ROWS], dTotal = 0.0;
+				for (int k = 0; k < PINK_ROWS; k++)
+				{
+					dRows[k] = olcRandom(row(nSeed, k), nSample >> (k + 1));
+					dTotal += dRows[k];
+				}
+				for (size_t i = 0; i < nSamples; i++)
+				{
+					uint64_t nPosition = nSample + i;
+					for (int k = 0; i > 0 && k < PINK_ROWS && (nPosition & ((2ULL << k) - 1)) == 0; k++)
+					{
+						FTYPE dRow = olcRandom(row(nSeed, k), nPosition >> (k + 1));
+						dTotal += dRow - dRows[k];
+						dRows[k] = dRow;
+					}
+					pOut[i] = (pOut[i] + dTotal) * (1.0 / (FTYPE)(PINK_ROWS + 1));
+				}
 			}
+			nSample += nSamples;
+		}
 
-			// Amplitude should not be negative
-			if (dAmplitude <= 0.01)
-				dAmplitude = 0.0;
+	private:
+		static uint32_t row(uint32_t nSeed, int k)
+		{
+			return olcHash32(nSeed + 0x9e3779b9U * (uint32_t)(k + 1));
+		}
 
-			return dAmplitude;
+		FTYPE brown(uint64_t nPosition)
+		{
+			dBrown = (dBrown + 0.02 * olcRandom(nSeed, nPosition)) / 1.02;
+			return fmax(fmin(dBrown * 3.5, 1.0), -1.0);
 		}
 	};
 
-	FTYPE env(const FTYPE dTime, envelope &env, const FTYPE dTimeOn, const FTYPE dTimeOff)
+	//////////////////////////////////////////////////////////////////////////////
+	// Wavetables
+
+	// One cycle of a waveform, stored several times over. Each level down has
+	// the top half of the harmonics of the one above it removed, so however
+	// high a note plays there is a level with nothing above the Nyquist
+	// frequency to alias. Lookups interpolate along the table, and fade
+	// between two levels, so nothing jumps as the pitch moves.
+	struct wavetable
 	{
-		return env.amplitude(dTime, dTimeOn, dTimeOff);
-	}
-
+		static constexpr int SIZE = 2048;
+		static constexpr int MAX_HARMONIC = SIZE / 2 - 1;
+		static constexpr int LEVELS = 12;	// The last level is silent, for notes above the Nyquist
 
-	struct instrument_base
-	{
-		FTYPE dVolume;
-		synth::envelope_adsr env;
-		FTYPE fMaxLifeTime;
-		wstring name;
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished) = 0;
-	};
+		vector<float> vecLevel[LEVELS];	// SIZE + 1 samples each, the last repeats the first
 
-	struct instrument_bell : public instrument_base
-	{
-		instrument_bell()
+		// Build from the strength of each harmonic, dCos[n] and dSin[n] for
+		// harmonic n (index 0 is ignored, there is no DC)
+		void Create(const vector<FTYPE> &dCos, const vector<FTYPE> &dSin)
 		{
-			env.dAttackTime = 0.01;
-			env.dDecayTime = 1.0;
-			env.dSustainAmplitude = 0.0;
-			env.dReleaseTime = 1.0;
-			fMaxLifeTime = 3.0;
-			dVolume = 1.0;
-			name = L"Bell";
+			// A sin table, so harmonic n at position i is just an index away
+			vector<FTYPE> vecSin(SIZE);
+			for (int i = 0; i < SIZE; i++)
+				vecSin[i] = sin(2.0 * PI * (FTYPE)i / (FTYPE)SIZE);
+
+			// Build from the bottom up, each level adding harmonics to the one below
+			vector<FTYPE> vecSum(SIZE, 0.0);
+			int nDone = 0;
+			for (int k = LEVELS - 1; k >= 0; k--)
+			{
+				int nTop = k == LEVELS - 1 ? 0 : min((int)MAX_HARMONIC, (SIZE / 2) >> k);
+				for (int n = nDone + 1; n <= nTop; n++)
+				{
+					FTYPE c = n < (int)dCos.size() ? dCos[n] : 0.0;
+					FTYPE s = n < (int)dSin.size() ? dSin[n] : 0.0;
+					if (c == 0.0 && s == 0.0)
+						continue;
+					for (int i = 0; i < SIZE; i++)
+					{
+						int j = (n * i) & (SIZE - 1);
+						vecSum[i] += s * vecSin[j] + c * vecSin[(j + SIZE / 4) & (SIZE - 1)];
+					}
+				}
+				nDone = max(nDone, nTop);
+
+				vecLevel[k].resize(SIZE + 1);
+				for (int i = 0; i < SIZE; i++)
+					vecLevel[k][i] = (float)vecSum[i];
+				vecLevel[k][SIZE] = vecLevel[k][0];
+			}
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		// Build from any single cycle of samples, by finding its harmonics
+		void Create(const vector<FTYPE> &vecCycle)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
+			size_t nLength = vecCycle.size();
+			int nHarmonics = min((int)MAX_HARMONIC, (int)(nLength / 2) - 1);
+			vector<FTYPE> dCos(nHarmonics + 1, 0.0), dSin(nHarmonics + 1, 0.0);
+			vector<FTYPE> vecSin(nLength), vecCos(nLength);
+			for (size_t i = 0; i < nLength; i++)
+			{
+				vecSin[i] = sin(2.0 * PI * (FTYPE)i / (FTYPE)nLength);
+				vecCos[i] = cos(2.0 * PI * (FTYPE)i / (FTYPE)nLength);
+			}
 
-			FTYPE dSound =
-				+ 1.00 * synth::osc(dTime - n.on, synth::scale(n.id + 12), synth::OSC_SINE, 5.0, 0.001)
-				+ 0.50 * synth::osc(dTime - n.on, synth::scale(n.id + 24))
-				+ 0.25 * synth::osc(dTime - n.on, synth::scale(n.id + 36));
+			for (int n = 1; n <= nHarmonics; n++)
+				for (size_t i = 0; i < nLength; i++)
+				{
+					size_t j = ((size_t)n * i) % nLength;
+					dSin[n] += vecCycle[i] * vecSin[j];
+					dCos[n] += vecCycle[i] * vecCos[j];
+				}
+			for (int n = 1; n <= nHarmonics; n++)
+			{
+				dSin[n] *= 2.0 / (FTYPE)nLength;
+				dCos[n] *= 2.0 / (FTYPE)nLength;
+			}
+			Create(dCos, dSin);
+		}
 
-			return dAmplitude * dSound * dVolume;
+		// Which two levels to use, and how far to fade to the second. dOctaves
+		// is how many octaves of harmonics to drop from the top level.
+		static void Level(FTYPE dOctaves, int &nLevel, FTYPE &dFade)
+		{
+			if (dOctaves <= 0.0)
+			{
+				nLevel = 0;
+				dFade = 0.0;
+				return;
+			}
+			FTYPE dLevel = floor(dOctaves);
+			nLevel = (int)min(dLevel, (FTYPE)(LEVELS - 2));
+			dFade = nLevel == (int)dLevel ? dOctaves - dLevel : 1.0;
 		}
 
+		// dPhase is from 0.0 to 1.0
+		FTYPE Sample(FTYPE dPhase, int nLevel, FTYPE dFade) const
+		{
+			FTYPE dPos = dPhase * (FTYPE)SIZE;
+			int i = min((int)dPos, SIZE - 1);
+			FTYPE dFrac = dPos - (FTYPE)i;
+			const float *a = vecLevel[nLevel].data() + i;
+			const float *b = vecLevel[nLevel + 1].data() + i;
+			FTYPE dA = a[0] + dFrac * (a[1] - a[0]);
+			FTYPE dB = b[0] + dFrac * (b[1] - b[0]);
+			return dA + dFade * (dB - dA);
+		}
 	};
 
-	struct instrument_bell8 : public instrument_base
+	// The built in waveforms, made once the first time they are needed
+	struct wavetables
 	{
-		instrument_bell8()
+		wavetable sine, square, triangle, saw;
+
+		wavetables()
 		{
-			env.dAttackTime = 0.01;
-			env.dDecayTime = 0.5;
-			env.dSustainAmplitude = 0.8;
-			env.dReleaseTime = 1.0;
-			fMaxLifeTime = 3.0;
-			dVolume = 1.0;
-			name = L"8-Bit Bell";
+			int N = wavetable::MAX_HARMONIC;
+			vector<FTYPE> dNone(N + 1, 0.0), dSine(N + 1, 0.0), dSquare(N + 1, 0.0), dTriangle(N + 1, 0.0), dSaw(N + 1, 0.0);
+			dSine[1] = 1.0;
+			for (int n = 1; n <= N; n++)
+			{
+				// The same harmonics the maths in wave() gives
+				dSaw[n] = (2.0 / PI) / (FTYPE)n;
+				if (n % 2 == 1)
+				{
+					dSquare[n] = (4.0 / PI) / (FTYPE)n;
+					dTriangle[n] = ((n / 2) % 2 == 0 ? 1.0 : -1.0) * (8.0 / (PI * PI)) / (FTYPE)(n * n);
+				}
+			}
+			sine.Create(dNone, dSine);
+			square.Create(dNone, dSquare);
+			triangle.Create(dNone, dTriangle);
+			saw.Create(dNone, dSaw);
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		const wavetable *Get(int nType) const
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
-
-			FTYPE dSound =
-				+1.00 * synth::osc(dTime - n.on, synth::scale(n.id), synth::OSC_SQUARE, 5.0, 0.001)
-				+ 0.50 * synth::osc(dTime - n.on, synth::scale(n.id + 12))
-				+ 0.25 * synth::osc(dTime - n.on, synth::scale(n.id + 24));
-
-			return dAmplitude * dSound * dVolume;
+			switch (nType)
+			{
+			case OSC_SINE: return &sine;
+			case OSC_SQUARE: return &square;
+			case OSC_TRIANGLE: return &triangle;
+			case OSC_SAW_ANA: return &saw;
+			default: return nullptr;
+			}
 		}
-
 	};
 
-	struct instrument_harmonica : public instrument_base
+	const wavetables &tables()
 	{
-		instrument_harmonica()
+		static wavetables t;
+		return t;
+	}
+
+	// osc() for a whole run of times at once, into pOut. The LFO, and sine
+	// waves, are worked out with the vector maths, which is several times
+	// cheaper than calling sin() for each sample.
+	void osc(const FTYPE *pTime, FTYPE *pOut, size_t nSamples, const FTYPE dHertz, const int nType = OSC_SINE,
+		const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0, FTYPE dCustom = 50.0)
+	{
+		thread_local vector<FTYPE> vecMod;
+		vecMod.assign(nSamples, 0.0);
+		if (dLFOAmplitude != 0.0)
 		{
-			env.dAttackTime = 0.00;
-			env.dDecayTime = 1.0;
-			env.dSustainAmplitude = 0.95;
-			env.dReleaseTime = 0.1;
-			fMaxLifeTime = -1.0;
-			name = L"Harmonica";
-			dVolume = 0.3;
+			for (size_t i = 0; i < nSamples; i++)
+				vecMod[i] = dLFOHertz * pTime[i];
+			olcSin2Pi(vecMod.data(), vecMod.data(), nSamples);
+			for (auto &d : vecMod)
+				d *= dLFOAmplitude * dHertz;
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		if (nType == OSC_SINE)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
-
-			FTYPE dSound =
-				+ 1.0  * synth::osc(n.on - dTime, synth::scale(n.id-12), synth::OSC_SAW_ANA, 5.0, 0.001, 100)
-				+ 1.00 * synth::osc(dTime - n.on, synth::scale(n.id), synth::OSC_SQUARE, 5.0, 0.001)
-				+ 0.50 * synth::osc(dTime - n.on, synth::scale(n.id + 12), synth::OSC_SQUARE)
-				+ 0.05  * synth::osc(dTime - n.on, synth::scale(n.id + 24), synth::OSC_NOISE);
-
-			return dAmplitude * dSound * dVolume;
+			for (size_t i = 0; i < nSamples; i++)
+				pOut[i] = dHertz * pTime[i] + vecMod[i] * (0.5 / PI);
+			olcSin2Pi(pOut, pOut, nSamples);
+			return;
 		}
 
-	};
-
+		for (size_t i = 0; i < nSamples; i++)
+		{
+			FTYPE dCycles = dHertz * pTime[i];
+			pOut[i] = wave(nType, dCycles - floor(dCycles), vecMod[i], dCustom, pTime[i]);
+		}
+	}
 
-	struct instrument_drumkick : public instrument_base
+	// An oscillator that remembers where it is in its cycle, and moves on by
+	// however much time has passed since it was last asked. The phase is kept
+	// between 0 and 1, so it stays just as accurate however long it runs. The
+	// LFO is a point going round a circle, turned a little each sample, which
+	// saves working out its sin. Same arguments as osc(). Sine, square,
+	// triangle and analogue saw are read from the wavetables, and the digital
+	// saw has its edge smoothed by wave_blep(), so none of them alias much.
+	// Noise comes from the oscillator's own seed, see struct noise.
+	struct oscillator
 	{
-		instrument_drumkick()
+		FTYPE dPhase = 0.0;
+		FTYPE dLFOCos = 1.0, dLFOSin = 0.0;	// The LFO's point
+		FTYPE dStepCos = 1.0, dStepSin = 0.0;	// How far to turn it each step
+		FTYPE dLastTime = 0.0;
+		FTYPE dLastStep = 0.0, dLastLFOHertz = 0.0;
+		int nLevel = 0;				// Wavetable levels in use, and the fade between them
+		FTYPE dFade = 0.0;
+		FTYPE dLevelCycles = -1.0, dLevelHarmonics = -1.0;	// What they were worked out for
+		noise rng;				// For the noise waveforms, a sample each time it is asked
+
+		// Back to the start of the cycle, ready for time 0
+		void reset()
 		{
-			env.dAttackTime = 0.01;
-			env.dDecayTime = 0.15;
-			env.dSustainAmplitude = 0.0;
-			env.dReleaseTime = 0.0;
-			fMaxLifeTime = 1.5;
-			name = L"Drum Kick";
-			dVolume = 1.0;
+			*this = oscillator();
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		FTYPE operator()(const FTYPE dTime, const FTYPE dHertz, const int nType = OSC_SINE,
+			const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0, FTYPE dCustom = 50.0)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if(fMaxLifeTime > 0.0 && dTime - n.on >= fMaxLifeTime)	bNoteFinished = true;
+			switch (nType)
+			{
+			case OSC_SINE: return kernel<OSC_SINE, true>(dTime, dHertz, dLFOHertz, dLFOAmplitude, dCustom);
+			case OSC_SQUARE: return kernel<OSC_SQUARE, true>(dTime, dHertz, dLFOHertz, dLFOAmplitude, dCustom);
+			case OSC_TRIANGLE: return kernel<OSC_TRIANGLE, true>(dTime, dHertz, dLFOHertz, dLFOAmplitude, dCustom);
+			case OSC_SAW_ANA: return kernel<OSC_SAW_ANA, true>(dTime, dHertz, dLFOHertz, dLFOAmplitude, dCustom);
+			case OSC_SAW_DIG: return kernel<OSC_SAW_DIG, true>(dTime, dHertz, dLFOHertz, dLFOAmplitude, dCustom);
+			case OSC_NOISE: return kernel<OSC_NOISE, true>(dTime, dHertz, dLFOHertz, dLFOAmplitude, dCustom);
+			case OSC_NOISE_PINK: return kernel<OSC_NOISE_PINK, true>(dTime, dHertz, dLFOHertz, dLFOAmplitude, dCustom);
+			case OSC_NOISE_BROWN: return kernel<OSC_NOISE_BROWN, true>(dTime, dHertz, dLFOHertz, dLFOAmplitude, dCustom);
+			default:
+				return wave(nType, dPhase, advance<true>(dTime, dHertz, dLFOHertz, dLFOAmplitude), dCustom, dTime);
+			}
+		}
 
-			FTYPE dSound =
-				+ 0.99 * synth::osc(dTime - n.on, synth::scale(n.id - 36), synth::OSC_SINE, 1.0, 1.0)
-				+ 0.01 * synth::osc(dTime - n.on, 0, synth::OSC_NOISE);
-				
-			return dAmplitude * dSound * dVolume;
+		// The same, with the waveform fixed when the instrument is compiled, so
+		// everything that does not apply to it drops away. LFO says whether the
+		// LFO is used at all, and PARTIALS is dCustom, the analogue saw's
+		// harmonics. e.g. n.osc[0].play<OSC_SQUARE>(dTime, dHertz, 5.0, 0.001)
+		template<int TYPE, bool LFO = true, int PARTIALS = 50>
+		FTYPE play(const FTYPE dTime, const FTYPE dHertz, const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0)
+		{
+			return kernel<TYPE, LFO>(dTime, dHertz, dLFOHertz, dLFOAmplitude, (FTYPE)PARTIALS);
 		}
 
-	};
+		// An exact sine rather than the wavetable's, silent at or above the
+		// Nyquist frequency. instrument_partials plays its sines with this,
+		// the same whether a voice plays alone or in lanes.
+		FTYPE sine(const FTYPE dTime, const FTYPE dHertz, const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0)
+		{
+			FTYPE dCycles = dHertz * (dTime - dLastTime);
+			FTYPE dMod = advance<true>(dTime, dHertz, dLFOHertz, dLFOAmplitude);
+			FTYPE dSin, dCos;
+			olcSinCos2PiKernel<olcVecScalar>(dPhase + dMod * (0.5 / PI), dSin, dCos);
+			return dCycles < 0.5 ? dSin : 0.0;
+		}
 
-	struct instrument_drumsnare : public instrument_base
-	{
-		instrument_drumsnare()
+		// Plays a wavetable of your own, made with wavetable::Create()
+		FTYPE operator()(const FTYPE dTime, const wavetable &table, const FTYPE dHertz,
+			const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0)
 		{
-			env.dAttackTime = 0.0;
-			env.dDecayTime = 0.2;
-			env.dSustainAmplitude = 0.0;
-			env.dReleaseTime = 0.0;
-			fMaxLifeTime = 1.0;
-			name = L"Drum Snare";
-			dVolume = 1.0;
+			FTYPE dStep = dTime - dLastTime;
+			FTYPE dMod = advance<true>(dTime, dHertz, dLFOHertz, dLFOAmplitude);
+			return lookup(table, dHertz * dStep, (FTYPE)wavetable::MAX_HARMONIC, dMod);
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+	private:
+		template<int TYPE, bool LFO>
+		FTYPE kernel(const FTYPE dTime, const FTYPE dHertz, const FTYPE dLFOHertz, const FTYPE dLFOAmplitude, const FTYPE dCustom)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (fMaxLifeTime > 0.0 && dTime - n.on >= fMaxLifeTime)	bNoteFinished = true;
+			FTYPE dStep = dTime - dLastTime;
+			FTYPE dMod = advance<LFO>(dTime, dHertz, dLFOHertz, dLFOAmplitude);
 
-			FTYPE dSound =
-				+ 0.5 * synth::osc(dTime - n.on, synth::scale(n.id - 24), synth::OSC_SINE, 0.5, 1.0)
-				+ 0.5 * synth::osc(dTime - n.on, 0, synth::OSC_NOISE);
+			if (TYPE == OSC_NOISE || TYPE == OSC_NOISE_PINK || TYPE == OSC_NOISE_BROWN)
+				return rng(TYPE);
+			if (TYPE == OSC_SAW_DIG)
+				return wave_blep(TYPE, modulated(dMod), dHertz * dStep);
 
-			return dAmplitude * dSound * dVolume;
+			// The analogue saw only has the harmonics below dCustom
+			FTYPE dHarmonics = TYPE == OSC_SAW_ANA ? max(ceil(dCustom) - 1.0, 0.0) : (FTYPE)wavetable::MAX_HARMONIC;
+			return lookup(*tables().Get(TYPE), dHertz * dStep, dHarmonics, dMod);
 		}
 
-	};
+		// Moves the phase and LFO on to dTime, and returns the LFO's phase
+		// offset in radians. Without LFO it is always 0.
+		template<bool LFO>
+		FTYPE advance(const FTYPE dTime, const FTYPE dHertz, const FTYPE dLFOHertz, const FTYPE dLFOAmplitude)
+		{
+			FTYPE dStep = dTime - dLastTime;
+			dLastTime = dTime;
 
+			dPhase += dHertz * dStep;
+			dPhase -= floor(dPhase);
 
-	struct instrument_drumhihat : public instrument_base
-	{
-		instrument_drumhihat()
-		{
-			env.dAttackTime = 0.01;
-			env.dDecayTime = 0.05;
-			env.dSustainAmplitude = 0.0;
-			env.dReleaseTime = 0.0;
-			fMaxLifeTime = 1.0;
-			name = L"Drum HiHat";
-			dVolume = 0.5;
+			if (!LFO)
+				return 0.0;
+
+			if (dLFOAmplitude != 0.0)
+			{
+				// The turn only needs working out again if the step changes
+				if (fabs(dStep - dLastStep) > 1e-9 * fabs(dLastStep) || dLFOHertz != dLastLFOHertz)
+				{
+					dStepCos = cos(w(dLFOHertz) * dStep);
+					dStepSin = sin(w(dLFOHertz) * dStep);
+					dLastStep = dStep;
+					dLastLFOHertz = dLFOHertz;
+				}
+
+				FTYPE c = dLFOCos * dStepCos - dLFOSin * dStepSin;
+				FTYPE s = dLFOSin * dStepCos + dLFOCos * dStepSin;
+
+				// Keep the point on the circle, rounding would slowly move it off
+				FTYPE dFix = 1.5 - 0.5 * (c * c + s * s);
+				dLFOCos = c * dFix;
+				dLFOSin = s * dFix;
+			}
+
+			return dLFOAmplitude * dHertz * dLFOSin;
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		// dCycles is how much of a cycle passes each sample, which decides how
+		// many harmonics fit below the Nyquist frequency. The levels are only
+		// chosen again when it, or the harmonics wanted, change.
+		FTYPE lookup(const wavetable &table, FTYPE dCycles, const FTYPE dHarmonics, const FTYPE dMod)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (fMaxLifeTime > 0.0 && dTime - n.on >= fMaxLifeTime)	bNoteFinished = true;
-
-			FTYPE dSound =
-				+ 0.1 * synth::osc(dTime - n.on, synth::scale(n.id -12), synth::OSC_SQUARE, 1.5, 1)
-				+ 0.9 * synth::osc(dTime - n.on, 0, synth::OSC_NOISE);
+			dCycles = fabs(dCycles);
+			if (fabs(dCycles - dLevelCycles) > 1e-6 * dLevelCycles || dHarmonics != dLevelHarmonics)
+			{
+				// Anything above the Nyquist frequency must go, even while fading, so
+				// that is a whole level further down than the harmonics that fit.
+				// Fewer harmonics asked for just fade between the nearest levels.
+				FTYPE dTop = (FTYPE)(wavetable::SIZE / 2);
+				FTYPE dOctaves = dHarmonics > 0.0 ? log2(dTop / dHarmonics) : (FTYPE)wavetable::LEVELS;
+				if (dCycles > 0.0)
+					dOctaves = max(dOctaves, log2(dTop * 2.0 * dCycles) + 1.0);
+				wavetable::Level(dOctaves, nLevel, dFade);
+				dLevelCycles = dCycles;
+				dLevelHarmonics = dHarmonics;
+			}
 
-			return dAmplitude * dSound * dVolume;
+			return table.Sample(modulated(dMod), nLevel, dFade);
 		}
 
+		// The phase with the LFO's offset added, still between 0 and 1
+		FTYPE modulated(const FTYPE dMod) const
+		{
+			FTYPE p = dPhase + dMod * (0.5 / PI);
+			return p - floor(p);
+		}
 	};
 
+	const int MAX_OSCILLATORS = 4;
 
-	struct sequencer
+	struct instrument_base;
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Envelopes
+
+	const int ENV_LINEAR = 0;
+	const int ENV_EXPONENTIAL = 1;	// Quick at first then slowing, like a capacitor charging
+
+	struct envelope
+	{
+		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) = 0;
+	};
+
+	struct envelope_adsr : public envelope
+	{
+		FTYPE dAttackTime;
+		FTYPE dDecayTime;
+		FTYPE dSustainAmplitude;
+		FTYPE dReleaseTime;
+		FTYPE dStartAmplitude;
+		int nAttackCurve = ENV_LINEAR;
+		int nDecayCurve = ENV_LINEAR;
+		int nReleaseCurve = ENV_LINEAR;
+
+		// How far past its end an exponential segment aims, as a share of
+		// its height. It gets to its end exactly on time, still moving.
+		static constexpr FTYPE ATTACK_OVERSHOOT = 0.3;
+		static constexpr FTYPE FALL_OVERSHOOT = 0.0001;
+
+		envelope_adsr()
+		{
+			dAttackTime = 0.1;
+			dDecayTime = 0.1;
+			dSustainAmplitude = 1.0;
+			dReleaseTime = 0.2;
+			dStartAmplitude = 1.0;
+		}
+
+		// Works the amplitude out from the times alone. Notes use an
+		// envelope_generator instead, which gives the same shape a sample at
+		// a time; this is for looking at the envelope from anywhere.
+		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff)
+		{
+			FTYPE dAmplitude = 0.0;
+
+			if (dTimeOn > dTimeOff) // Note is on
+				dAmplitude = held(dTime - dTimeOn);
+			else // Note is off, fall from wherever it had got to
+			{
+				FTYPE dReleaseAmplitude = held(dTimeOff - dTimeOn);
+				FTYPE dReleased = dTime - dTimeOff;
+				if (dReleased < dReleaseTime)
+					dAmplitude = segment(dReleaseAmplitude, 0.0, dReleased / dReleaseTime, nReleaseCurve, FALL_OVERSHOOT);
+			}
+
+			// Amplitude should not be negative
+			if (dAmplitude <= 0.01)
+				dAmplitude = 0.0;
+
+			return dAmplitude;
+		}
+
+		// dAlong (0.0 to 1.0) of the way from dFrom to dTo
+		static FTYPE segment(FTYPE dFrom, FTYPE dTo, FTYPE dAlong, int nCurve, FTYPE dOvershoot)
+		{
+			if (nCurve == ENV_LINEAR || dFrom == dTo)
+				return dFrom + (dTo - dFrom) * dAlong;
+			FTYPE dTarget = dTo + (dTo - dFrom) * dOvershoot;
+			return dTarget + (dFrom - dTarget) * pow((dTo - dTarget) / (dFrom - dTarget), dAlong);
+		}
+
+	private:
+		// Attack, decay and sustain, dLifeTime after the note started
+		FTYPE held(FTYPE dLifeTime) const
+		{
+			if (dLifeTime < dAttackTime)
+				return segment(0.0, dStartAmplitude, dLifeTime / dAttackTime, nAttackCurve, ATTACK_OVERSHOOT);
+			dLifeTime -= dAttackTime;
+			if (dLifeTime < dDecayTime)
+				return segment(dStartAmplitude, dSustainAmplitude, dLifeTime / dDecayTime, nDecayCurve, FALL_OVERSHOOT);
+			return dSustainAmplitude;
+		}
+	};
+
+	FTYPE env(const FTYPE dTime, envelope &env, const FTYPE dTimeOn, const FTYPE dTimeOff)
+	{
+		return env.amplitude(dTime, dTimeOn, dTimeOff);
+	}
+
+	const int ENV_IDLE = 0;
+	const int ENV_ATTACK = 1;
+	const int ENV_DECAY = 2;
+	const int ENV_SUSTAIN = 3;
+	const int ENV_RELEASE = 4;
+	const int ENV_DONE = 5;
+
+	// An ADSR envelope for one voice, a sample at a time. It knows which
+	// stage it is in and how long that has left, and each sample is one
+	// multiply and one add: a straight line is a multiply by 1, and an
+	// exponential curve closes a fixed share of the gap to where it is aiming.
+	struct envelope_generator
+	{
+		int nStage = ENV_IDLE;
+		FTYPE dLevel = 0.0;
+		FTYPE dMul = 1.0, dAdd = 0.0;	// Each sample, dLevel = dLevel * dMul + dAdd
+		FTYPE dEnd = 0.0;		// Where the stage ends up
+		uint64_t nLeft = 0;		// Samples until it does
+		const envelope_adsr *pEnv = nullptr;
+		unsigned int nSampleRate = 44100;
+
+		void start(const envelope_adsr &env, unsigned int nRate)
+		{
+			pEnv = &env;
+			nSampleRate = nRate;
+			dLevel = 0.0;
+			stage(ENV_ATTACK);
+		}
+
+		// The key has been let go, fall from wherever it has got to
+		void release()
+		{
+			if (nStage != ENV_IDLE && nStage < ENV_RELEASE)
+				stage(ENV_RELEASE);
+		}
+
+		// The next nSamples into pOut. Like envelope_adsr::amplitude(), anything
+		// below 0.01 after the attack counts as silent. Silent until started.
+		void ramp(FTYPE *pOut, unsigned int nSamples)
+		{
+			if (nStage == ENV_IDLE || nStage == ENV_DONE)
+			{
+				fill(pOut, pOut + nSamples, 0.0);
+				return;
+			}
+
+			unsigned int i = 0;
+			while (i < nSamples)
+			{
+				unsigned int nRun = (unsigned int)min((uint64_t)(nSamples - i), nLeft);
+				FTYPE dQuiet = nStage == ENV_ATTACK ? -1.0 : 0.01;
+				for (unsigned int j = 0; j < nRun; j++)
+				{
+					dLevel = dLevel * dMul + dAdd;
+					pOut[i + j] = dLevel <= dQuiet ? 0.0 : dLevel;
+				}
+				i += nRun;
+				nLeft -= nRun;
+
+				if (nLeft == 0)
+				{
+					// Land exactly on the end of the stage
+					dLevel = dEnd;
+					pOut[i - 1] = dLevel <= 0.01 ? 0.0 : dLevel;
+					stage(nStage + 1);
+				}
+			}
+		}
+
+		FTYPE next()
+		{
+			FTYPE d;
+			ramp(&d, 1);
+			return d;
+		}
+
+	private:
+		void stage(int nNew)
+		{
+			nStage = nNew;
+			while (true)
+			{
+				FTYPE dTime, dOvershoot;
+				int nCurve;
+				switch (nStage)
+				{
+				case ENV_ATTACK: dEnd = pEnv->dStartAmplitude; dTime = pEnv->dAttackTime; nCurve = pEnv->nAttackCurve; dOvershoot = envelope_adsr::ATTACK_OVERSHOOT; break;
+				case ENV_DECAY: dEnd = pEnv->dSustainAmplitude; dTime = pEnv->dDecayTime; nCurve = pEnv->nDecayCurve; dOvershoot = envelope_adsr::FALL_OVERSHOOT; break;
+				case ENV_RELEASE: dEnd = 0.0; dTime = pEnv->dReleaseTime; nCurve = pEnv->nReleaseCurve; dOvershoot = envelope_adsr::FALL_OVERSHOOT; break;
+				default:
+					// Sustain, or done, hold where it is until told otherwise
+					if (nStage == ENV_DONE)
+						dLevel = 0.0;
+					dEnd = dLevel;
+					dMul = 1.0;
+					dAdd = 0.0;
+					nLeft = UINT64_MAX;
+					return;
+				}
+
+				nLeft = (uint64_t)llround(fmax(dTime, 0.0) * (FTYPE)nSampleRate);
+				if (nLeft > 0)
+				{
+					if (nCurve == ENV_LINEAR || dLevel == dEnd)
+					{
+						dMul = 1.0;
+						dAdd = (dEnd - dLevel) / (FTYPE)nLeft;
+					}
+					else
+					{
+						FTYPE dTarget = dEnd + (dEnd - dLevel) * dOvershoot;
+						dMul = pow((dEnd - dTarget) / (dLevel - dTarget), 1.0 / (FTYPE)nLeft);
+						dAdd = dTarget * (1.0 - dMul);
+					}
+					return;
+				}
+
+				// A stage of no length is over before it starts
+				dLevel = dEnd;
+				nStage = nStage == ENV_RELEASE ? ENV_DONE : nStage + 1;
+			}
+		}
+	};
+
+
+	// Where modulation sends its values, see instrument_base::mod
+	const int MOD_AMPLITUDE = 0;	// Scales the envelope by 1 + amount * source
+	const int MOD_PITCH = 1;	// Semitones, as a multiple of the frequency
+	const int MOD_PAN = 2;		// Added to the pan
+	const int MOD_DESTINATIONS = 3;
+
+	// A voice's modulation, worked out once a control period and drawn as a
+	// straight line from one to the next, see instrument_base::control()
+	struct control
+	{
+		FTYPE dAmplitude = 0.0;	// Values for the current sample
+		FTYPE dFrequency = 1.0;
+		FTYPE dPan = 0.0;
+		FTYPE dStart[MOD_DESTINATIONS];	// The line from nStart to nEnd
+		FTYPE dSlope[MOD_DESTINATIONS];
+		uint64_t nStart = 0;
+		uint64_t nEnd = 0;	// First sample of the next period, 0 to start again
+		envelope_generator eg;	// The voice's envelope, which dAmplitude follows
+	};
+
+	// A basic note
+	struct note
+	{
+		int id;		// Position in scale
+		FTYPE on;	// Time note was activated
+		FTYPE off;	// Time note was deactivated
+		bool active;
+		instrument_base *channel;
+		FTYPE pan;	// -1.0 (left) to +1.0 (right), added to the instrument's pan
+		FTYPE gain;	// Loudness of this voice in the mix
+		oscillator osc[MAX_OSCILLATORS];	// For the instrument to make its sound with
+		control ctl;	// Envelope, pitch and pan modulation, ready for the instrument
+
+		note()
+		{
+			id = 0;
+			on = 0.0;
+			off = 0.0;
+			active = false;
+			channel = nullptr;
+			pan = 0.0;
+			gain = 1.0;
+		}
+
+		// Ready to sound from the start, each oscillator's noise seeded from nSeed
+		void start(uint32_t nSeed)
+		{
+			for (int i = 0; i < MAX_OSCILLATORS; i++)
+			{
+				osc[i].reset();
+				osc[i].rng.nSeed = olcHash32(nSeed + (uint32_t)i);
+			}
+			ctl = control();
+		}
+
+		//bool operator==(const note& n1, const note& n2) { return n1.id == n2.id; }
+	};
+
+	// Instrument settings an event can change, rather than playing a note
+	const int PARAM_NONE = 0;
+	const int PARAM_VOLUME = 1;
+	const int PARAM_PAN = 2;
+
+	// A note switching on or off at an exact sample
+	struct note_event
+	{
+		uint64_t nSample;	// Sample the event takes effect at
+		bool bNoteOn;
+		bool bRetrigger;	// Note on restarts a sounding note with the same id and instrument, rather than adding another
+		note n;
+		int nParam = PARAM_NONE;	// If set, n.channel's setting becomes dValue and no note plays
+		FTYPE dValue = 0.0;
+	};
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Scale to Frequency conversion
+
+	// A tuning is a table of the frequency of every note, worked out once so
+	// playing a note is just a look up. Note ids are MIDI note numbers, more
+	// or less: the default tuning is the original one, 8Hz at note 0 and equal
+	// steps of a semitone, which puts A440 a third of a semitone above 69.
+	struct tuning
+	{
+		static const int LOWEST = -128;	// Notes outside the table play its first or last
+		static const int NOTES = 512;
+
+		FTYPE dHertz[NOTES];		// 0.0 for notes the tuning leaves out
+		wstring sName;
+
+		FTYPE hertz(int nNoteID) const
+		{
+			return dHertz[min(max(nNoteID - LOWEST, 0), NOTES - 1)];
+		}
+
+		// The original tuning
+		static tuning Default()
+		{
+			tuning t;
+			t.sName = L"Default";
+			t.fill([](int n) { return 8 * pow(1.0594630943592952645618252949463, n); });
+			return t;
+		}
+
+		// nDivisions equal steps to each dPeriod (2.0 is an octave), with
+		// nRefNote at dRefHertz
+		static tuning Equal(FTYPE dRefHertz = 440.0, int nRefNote = 69, int nDivisions = 12, FTYPE dPeriod = 2.0)
+		{
+			tuning t;
+			t.sName = L"Equal temperament";
+			t.fill([=](int n) { return dRefHertz * pow(dPeriod, (FTYPE)(n - nRefNote) / (FTYPE)nDivisions); });
+			return t;
+		}
+
+		// Five limit just intonation, in the key of nTonic at dTonicHertz
+		static tuning Just(int nTonic = 60, FTYPE dTonicHertz = 261.6255653005986)
+		{
+			const FTYPE dRatios[] = { 1.0, 16.0 / 15.0, 9.0 / 8.0, 6.0 / 5.0, 5.0 / 4.0, 4.0 / 3.0, 45.0 / 32.0,
+				3.0 / 2.0, 8.0 / 5.0, 5.0 / 3.0, 9.0 / 5.0, 15.0 / 8.0, 2.0 };
+			tuning t;
+			t.sName = L"Just intonation";
+			t.ratios(vector<FTYPE>(begin(dRatios), end(dRatios)), keyboard_map(nTonic, nTonic, dTonicHertz));
+			return t;
+		}
+
+		// A Scala scale file (.scl), and optionally a keyboard mapping (.kbm).
+		// Without a mapping, degree 0 is note 60 and note 69 is 440Hz. Returns
+		// false if either cannot be read.
+		bool LoadScala(const string &sScaleFile, const string &sMapFile = "")
+		{
+			vector<string> vecScale, vecMap;
+			if (!scala_lines(sScaleFile, vecScale) || vecScale.size() < 2)
+				return false;
+
+			// Description, how many notes, then each note's pitch
+			int nNotes = atoi(vecScale[1].c_str());
+			if (nNotes < 1 || (int)vecScale.size() < 2 + nNotes)
+				return false;
+			vector<FTYPE> vecRatios = { 1.0 };
+			for (int i = 0; i < nNotes; i++)
+			{
+				string p = vecScale[2 + i].substr(0, vecScale[2 + i].find_first_of(" \t"));
+				FTYPE dRatio;
+				if (p.find('.') != string::npos)
+					dRatio = exp2(atof(p.c_str()) / 1200.0);	// Cents
+				else
+				{
+					size_t nSlash = p.find('/');
+					dRatio = atof(p.c_str()) / (nSlash == string::npos ? 1.0 : atof(p.c_str() + nSlash + 1));
+				}
+				if (!(dRatio > 0.0) || !isfinite(dRatio))
+					return false;
+				vecRatios.push_back(dRatio);
+			}
+
+			keyboard_map map(60, 69, 440.0);
+			if (!sMapFile.empty())
+			{
+				// Size, first and last note, middle note, reference note and
+				// frequency, formal octave degree, then the mapping
+				if (!scala_lines(sMapFile, vecMap) || vecMap.size() < 7)
+					return false;
+				int nSize = atoi(vecMap[0].c_str());
+				map.nFirst = atoi(vecMap[1].c_str());
+				map.nLast = atoi(vecMap[2].c_str());
+				map.nMiddle = atoi(vecMap[3].c_str());
+				map.nRefNote = atoi(vecMap[4].c_str());
+				map.dRefHertz = atof(vecMap[5].c_str());
+				map.nOctaveDegree = atoi(vecMap[6].c_str());
+				for (int i = 0; i < nSize; i++)
+					map.vecDegrees.push_back(7 + i < (int)vecMap.size() && vecMap[7 + i][0] != 'x' ? atoi(vecMap[7 + i].c_str()) : -1);
+			}
+
+			tuning t;
+			t.sName = wstring(sScaleFile.begin(), sScaleFile.end());
+			if (!t.ratios(vecRatios, map))
+				return false;
+			*this = t;
+			return true;
+		}
+
+	private:
+		// Which scale degree each key plays, as a Scala .kbm file has it
+		struct keyboard_map
+		{
+			int nFirst = 0, nLast = 127;	// Keys outside these are silent
+			int nMiddle;			// Plays degree 0
+			int nRefNote;			// Plays dRefHertz
+			FTYPE dRefHertz;
+			int nOctaveDegree = 0;		// Degree the map repeats at, 0 for the scale's own period
+			vector<int> vecDegrees;		// Each key's degree from nMiddle, -1 for none; empty for one key per degree
+
+			keyboard_map(int nMiddleNote, int nReference, FTYPE dHertz) : nFirst(LOWEST), nLast(LOWEST + NOTES - 1),
+				nMiddle(nMiddleNote), nRefNote(nReference), dRefHertz(dHertz) {}
+		};
+
+		template<class F>
+		void fill(F fHertz)
+		{
+			for (int i = 0; i < NOTES; i++)
+				dHertz[i] = fHertz(LOWEST + i);
+		}
+
+		// vecRatios runs from degree 0 (1.0) to the period, the ratio the scale repeats at
+		bool ratios(const vector<FTYPE> &vecRatios, const keyboard_map &map)
+		{
+			int nDegrees = (int)vecRatios.size() - 1;
+			FTYPE dPeriod = vecRatios.back();
+			auto degree = [&](int d)
+			{
+				int nRepeat = (int)floor((FTYPE)d / (FTYPE)nDegrees);
+				return pow(dPeriod, (FTYPE)nRepeat) * vecRatios[d - nRepeat * nDegrees];
+			};
+
+			// Ratio of a key to the middle note, 0.0 if it has none
+			int nSize = (int)map.vecDegrees.size();
+			FTYPE dOctave = map.nOctaveDegree > 0 ? degree(map.nOctaveDegree) : dPeriod;
+			auto key = [&](int n) -> FTYPE
+			{
+				if (n < map.nFirst || n > map.nLast)
+					return 0.0;
+				int d = n - map.nMiddle;
+				if (nSize == 0)
+					return degree(d);
+				int nRepeat = (int)floor((FTYPE)d / (FTYPE)nSize);
+				int nDegree = map.vecDegrees[d - nRepeat * nSize];
+				return nDegree < 0 ? 0.0 : degree(nDegree) * pow(dOctave, (FTYPE)nRepeat);
+			};
+
+			FTYPE dRef = key(map.nRefNote);
+			if (!(dRef > 0.0))
+				return false;
+			fill([&](int n) { return map.dRefHertz * key(n) / dRef; });
+			return true;
+		}
+
+		// The lines of a Scala file that are not comments, each trimmed
+		static bool scala_lines(const string &sFile, vector<string> &vecLines)
+		{
+			ifstream f(sFile);
+			if (!f.is_open())
+				return false;
+			string sLine;
+			while (getline(f, sLine))
+			{
+				if (!sLine.empty() && sLine[0] == '!')
+					continue;
+				size_t a = sLine.find_first_not_of(" \t\r");
+				size_t b = sLine.find_last_not_of(" \t\r");
+				vecLines.push_back(a == string::npos ? string() : sLine.substr(a, b - a + 1));
+			}
+			return true;
+		}
+	};
+
+	// The tuning everything plays in. set_tuning() can be called from any
+	// thread while notes play: the table is made by the caller and swapped in
+	// with a single atomic store, so the audio thread never waits or allocates.
+	// Old tables are kept, they are small and a voice may still be reading one.
+	struct tunings
+	{
+		atomic<const tuning*> pCurrent;
+		list<unique_ptr<tuning>> listAll;
+		mutex muxSet;
+
+		tunings()
+		{
+			listAll.emplace_back(new tuning(tuning::Default()));
+			pCurrent = listAll.back().get();
+		}
+	};
+
+	tunings &all_tunings()
+	{
+		static tunings t;
+		return t;
+	}
+
+	const tuning &get_tuning()
+	{
+		return *all_tunings().pCurrent.load(memory_order_acquire);
+	}
+
+	void set_tuning(const tuning &t)
+	{
+		tunings &all = all_tunings();
+		unique_ptr<tuning> pNew(new tuning(t));
+		lock_guard<mutex> lock(all.muxSet);
+		all.pCurrent.store(pNew.get(), memory_order_release);
+		all.listAll.push_back(move(pNew));
+	}
+
+	const int SCALE_DEFAULT = 0;
+
+	// A note's frequency in the current tuning
+	FTYPE scale(const int nNoteID, const int nScaleID = SCALE_DEFAULT)
+	{
+		switch (nScaleID)
+		{
+		case SCALE_DEFAULT: default:
+			return get_tuning().hertz(nNoteID);
+		}		
+	}
+
+
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Modulation
+
+	// Where modulation comes from
+	const int MOD_ENVELOPE = 0;	// The instrument's envelope, 0.0 to 1.0
+	const int MOD_LFO1 = 1;		// Sine waves from the start of the note, -1.0 to +1.0
+	const int MOD_LFO2 = 2;
+
+	// Sends amount times a source to a destination
+	struct mod_route
+	{
+		int nSource;
+		int nDestination;
+		FTYPE dAmount;
+	};
+
+	// An instrument's modulation. It is worked out every nControlPeriod
+	// samples, counted from the very first sample so every voice and every
+	// render agrees where they fall, and drawn as straight lines between.
+	// Fewer samples follow fast changes more closely, and 1 works out every
+	// sample exactly.
+	struct modulation
+	{
+		unsigned int nControlPeriod = 32;
+		FTYPE dLFOHertz[2] = { 5.0, 0.5 };
+		vector<mod_route> vecRoutes;
+
+		bool Sends(int nDestination) const
+		{
+			for (auto &r : vecRoutes)
+				if (r.nDestination == nDestination)
+					return true;
+			return false;
+		}
+	};
+
+
+	// Voices an instrument can play at once, a voice to a lane, see
+	// instrument_base::sound_lanes(). The widest vectors take them all at once.
+	const unsigned int LANES = 8;
+
+	// Room to work out a group of voices side by side. What changes from frame
+	// to frame is kept frame after frame, with the lanes together inside each
+	// frame, so one vector load picks up the same thing for every voice. The
+	// oscillators are copied in to lanes the same way while they are played.
+	struct voice_lanes
+	{
+		vector<FTYPE> vecOut;		// The voices' sound
+		vector<FTYPE> vecAmplitude;	// Their n.ctl, every frame
+		vector<FTYPE> vecFrequency;
+		vector<FTYPE> vecPan;
+		vector<FTYPE> vecEnvelope;	// Voice after voice, each a block's frames
+		unsigned int nEnd[LANES];	// Frame after each voice's last
+		bool bFinished[LANES];
+
+		// Frames worked on at a time, few enough that they all stay in the cache
+		static const unsigned int CHUNK = 64;
+		FTYPE dNoise[CHUNK];
+
+		FTYPE dOn[LANES];
+		FTYPE dPhase[MAX_OSCILLATORS][LANES];
+		FTYPE dLastTime[MAX_OSCILLATORS][LANES];
+		FTYPE dHertz[MAX_OSCILLATORS][LANES];
+		FTYPE dLFOCos[MAX_OSCILLATORS][LANES];
+		FTYPE dLFOSin[MAX_OSCILLATORS][LANES];
+
+		void Size(unsigned int nFrames)
+		{
+			if (vecOut.size() >= nFrames * LANES)
+				return;
+			vecOut.resize(nFrames * LANES);
+			vecAmplitude.resize(nFrames * LANES);
+			vecFrequency.resize(nFrames * LANES);
+			vecPan.resize(nFrames * LANES);
+			vecEnvelope.resize(nFrames * LANES);
+		}
+	};
+
+	struct instrument_base
+	{
+		FTYPE dVolume;
+		FTYPE dPan = 0.0;
+		synth::envelope_adsr env;
+		FTYPE fMaxLifeTime;
+		wstring name;
+		synth::modulation mod;
+
+		// One sample of note n. n.ctl holds its envelope and modulation.
+		virtual FTYPE sound(const FTYPE dTime, synth::note &n, bool &bNoteFinished) = 0;
+
+		// Frames f0 up to (not including) f1 of note n into pOut, pTime being
+		// the time of each frame. Stops once the note finishes, and returns the
+		// frame after the last it made. If pPan is given it gets each frame's
+		// pan modulation.
+		virtual unsigned int sound_block(const olcNoiseBlock &block, const FTYPE *pTime, unsigned int f0, unsigned int f1,
+			synth::note &n, FTYPE *pOut, FTYPE *pPan, bool &bNoteFinished)
+		{
+			envelope(n, block.nSampleRate, pOut + f0, f1 - f0);
+			for (unsigned int f = f0; f < f1; f++)
+			{
+				control(n, block.nStartSample + f, block.nSampleRate, pOut[f]);
+				pOut[f] = sound(pTime[f], n, bNoteFinished);
+				if (pPan) pPan[f] = n.ctl.dPan;
+				if (bNoteFinished)
+					return f + 1;
+			}
+			return f1;
+		}
+
+		// Instruments that can play up to LANES voices at once say so, and
+		// their sound_lanes() does what sound_block() does for all of pNotes
+		// together, leaving each voice's frames, and where it stopped, in lanes.
+		virtual bool lanes() const { return false; }
+		virtual void sound_lanes(const olcNoiseBlock & /*block*/, const FTYPE * /*pTime*/, unsigned int /*f0*/, unsigned int /*f1*/,
+			synth::note ** /*pNotes*/, unsigned int /*nNotes*/, voice_lanes & /*lanes*/) {}
+
+		// The next nSamples of note n's envelope into pOut, in one go. Notes
+		// only start and stop between calls, never part way through.
+		void envelope(synth::note &n, unsigned int nSampleRate, FTYPE *pOut, unsigned int nSamples)
+		{
+			synth::envelope_generator &eg = n.ctl.eg;
+			if (eg.nStage == ENV_IDLE)
+				eg.start(env, nSampleRate);
+			if (!(n.on > n.off))
+				eg.release();
+			eg.ramp(pOut, nSamples);
+		}
+
+		// Brings n.ctl up to sample nSample, dEnvelope being the envelope
+		// there. Most samples only move along the line, the modulators are
+		// worked out at the end of each period.
+		void control(synth::note &n, uint64_t nSample, unsigned int nSampleRate, FTYPE dEnvelope)
+		{
+			synth::control &c = n.ctl;
+			if (nSample >= c.nEnd || nSample < c.nStart)
+			{
+				uint64_t nPeriod = max(mod.nControlPeriod, 1u);
+				uint64_t nEnd = (nSample / nPeriod + 1) * nPeriod;
+				FTYPE dEnd[MOD_DESTINATIONS];
+				targets(n, nSample, nSampleRate, c.dStart);
+				targets(n, nEnd, nSampleRate, dEnd);
+				for (int d = 0; d < MOD_DESTINATIONS; d++)
+					c.dSlope[d] = (dEnd[d] - c.dStart[d]) / (FTYPE)(nEnd - nSample);
+				c.nStart = nSample;
+				c.nEnd = nEnd;
+			}
+
+			FTYPE dAlong = (FTYPE)(nSample - c.nStart);
+			c.dAmplitude = dEnvelope * (c.dStart[MOD_AMPLITUDE] + c.dSlope[MOD_AMPLITUDE] * dAlong);
+			c.dFrequency = c.dStart[MOD_PITCH] + c.dSlope[MOD_PITCH] * dAlong;
+			c.dPan = c.dStart[MOD_PAN] + c.dSlope[MOD_PAN] * dAlong;
+		}
+
+	private:
+		// The modulation at exactly sample nSample
+		void targets(const synth::note &n, uint64_t nSample, unsigned int nSampleRate, FTYPE *pValues)
+		{
+			FTYPE dTime = (FTYPE)nSample / (FTYPE)nSampleRate;
+			FTYPE dSources[3] = { 0.0, 0.0, 0.0 };
+			FTYPE dSum[MOD_DESTINATIONS] = { 1.0, 0.0, 0.0 };
+			for (auto &r : mod.vecRoutes)
+			{
+				if (r.nSource == MOD_ENVELOPE)
+					dSources[r.nSource] = env.amplitude(dTime, n.on, n.off);
+				else
+					dSources[r.nSource] = olcSin2Pi(mod.dLFOHertz[r.nSource - MOD_LFO1] * (dTime - n.on));
+				dSum[r.nDestination] += r.dAmount * dSources[r.nSource];
+			}
+
+			pValues[MOD_AMPLITUDE] = fmax(dSum[MOD_AMPLITUDE], 0.0);
+			pValues[MOD_PITCH] = dSum[MOD_PITCH] == 0.0 ? 1.0 : exp2(dSum[MOD_PITCH] / 12.0);
+			pValues[MOD_PAN] = dSum[MOD_PAN];
+		}
+	};
+
+	// Instruments derive from this, giving themselves as T. Each then gets a
+	// sound_block() of its own with its sound() inlined into the loop, rather
+	// than a virtual call for every sample.
+	template<class T>
+	struct instrument : public instrument_base
+	{
+		unsigned int sound_block(const olcNoiseBlock &block, const FTYPE *pTime, unsigned int f0, unsigned int f1,
+			synth::note &n, FTYPE *pOut, FTYPE *pPan, bool &bNoteFinished) override
+		{
+			T &self = *static_cast<T*>(this);
+			envelope(n, block.nSampleRate, pOut + f0, f1 - f0);
+			for (unsigned int f = f0; f < f1; f++)
+			{
+				control(n, block.nStartSample + f, block.nSampleRate, pOut[f]);
+				pOut[f] = self.T::sound(pTime[f], n, bNoteFinished);
+				if (pPan) pPan[f] = n.ctl.dPan;
+				if (bNoteFinished)
+					return f + 1;
+			}
+			return f1;
+		}
+	};
+
+	// One part of an instrument_partials' sound: a sine some semitones from
+	// the note, with a vibrato of its own, or white noise
+	struct partial
+	{
+		int nType;		// OSC_SINE or OSC_NOISE
+		FTYPE dLevel;
+		int nSemitones = 0;
+		FTYPE dLFOHertz = 0.0;
+		FTYPE dLFOAmplitude = 0.0;
+	};
+
+	// An instrument that is only a sum of partials, one oscillator each. As
+	// every voice does the same sums, it plays LANES of them at once, a voice
+	// to each lane of the vector maths.
+	struct instrument_partials : public instrument<instrument_partials>
+	{
+		vector<partial> vecPartials;
+		bool bUntilSilent = true;	// Finishes with its envelope, otherwise after fMaxLifeTime
+
+		FTYPE sound(const FTYPE dTime, synth::note &n, bool &bNoteFinished)
+		{
+			FTYPE dAmplitude = n.ctl.dAmplitude;
+			if (bUntilSilent ? dAmplitude <= 0.0 : fMaxLifeTime > 0.0 && dTime - n.on >= fMaxLifeTime)
+				bNoteFinished = true;
+
+			FTYPE dSound = 0.0;
+			for (size_t p = 0; p < vecPartials.size() && p < MAX_OSCILLATORS; p++)
+			{
+				const partial &q = vecPartials[p];
+				if (q.nType == OSC_NOISE)
+					dSound += q.dLevel * n.osc[p](dTime - n.on, 0.0, OSC_NOISE);
+				else
+					dSound += q.dLevel * n.osc[p].sine(dTime - n.on, synth::scale(n.id + q.nSemitones) * n.ctl.dFrequency, q.dLFOHertz, q.dLFOAmplitude);
+			}
+
+			return dAmplitude * dSound * dVolume;
+		}
+
+		bool lanes() const override { return true; }
+
+		void sound_lanes(const olcNoiseBlock &block, const FTYPE *pTime, unsigned int f0, unsigned int f1,
+			synth::note **pNotes, unsigned int nNotes, voice_lanes &lanes) override
+		{
+			lanes.Size(block.nFrames);
+			unsigned int nPartials = (unsigned int)min(vecPartials.size(), (size_t)MAX_OSCILLATORS);
+			bool bModulated = !mod.vecRoutes.empty();
+			bool bPan = mod.Sends(MOD_PAN);
+
+			// Only whole vectors of lanes are worked on, spare lanes in them stay silent
+			unsigned int nLanes = min((nNotes + olcVec::N - 1) / olcVec::N * olcVec::N, LANES);
+			for (unsigned int l = 0; l < nLanes; l++)
+			{
+				lanes.nEnd[l] = f1;
+				lanes.bFinished[l] = false;
+				lanes.dOn[l] = l < nNotes ? pNotes[l]->on : 0.0;
+				for (unsigned int p = 0; p < nPartials; p++)
+				{
+					const oscillator *o = l < nNotes ? &pNotes[l]->osc[p] : nullptr;
+					lanes.dPhase[p][l] = o ? o->dPhase : 0.0;
+					lanes.dLastTime[p][l] = o ? o->dLastTime : 0.0;
+					lanes.dHertz[p][l] = o ? synth::scale(pNotes[l]->id + vecPartials[p].nSemitones) : 0.0;
+					lanes.dLFOCos[p][l] = o ? o->dLFOCos : 1.0;
+					lanes.dLFOSin[p][l] = o ? o->dLFOSin : 0.0;
+				}
+				if (l < nNotes)
+					envelope(*pNotes[l], block.nSampleRate, lanes.vecEnvelope.data() + l * block.nFrames + f0, f1 - f0);
+			}
+
+			// A few frames at a time, so everything being worked on stays in the cache
+			for (unsigned int c0 = f0; c0 < f1; c0 += voice_lanes::CHUNK)
+			{
+				unsigned int c1 = min(c0 + voice_lanes::CHUNK, f1);
+				FTYPE *pOut = lanes.vecOut.data();
+				FTYPE *pAmplitude = lanes.vecAmplitude.data();
+				FTYPE *pFrequency = lanes.vecFrequency.data();
+				fill(pOut + c0 * LANES, pOut + c1 * LANES, 0.0);
+				fill(pAmplitude + c0 * LANES, pAmplitude + c1 * LANES, 0.0);
+				fill(pFrequency + c0 * LANES, pFrequency + c1 * LANES, 1.0);
+
+				// The envelopes and modulation, a voice at a time. Without any
+				// modulation the amplitude is just the envelope.
+				for (unsigned int l = 0; l < nNotes; l++)
+				{
+					synth::note &n = *pNotes[l];
+					const FTYPE *pEnvelope = lanes.vecEnvelope.data() + l * block.nFrames;
+					if (!bModulated)
+					{
+						for (unsigned int f = c0; f < c1; f++)
+							pAmplitude[f * LANES + l] = pEnvelope[f];
+						continue;
+					}
+					for (unsigned int f = c0; f < c1; f++)
+					{
+						control(n, block.nStartSample + f, block.nSampleRate, pEnvelope[f]);
+						pAmplitude[f * LANES + l] = n.ctl.dAmplitude;
+						pFrequency[f * LANES + l] = n.ctl.dFrequency;
+						if (bPan) lanes.vecPan[f * LANES + l] = n.ctl.dPan;
+					}
+				}
+
+				for (unsigned int p = 0; p < nPartials; p++)
+				{
+					const partial &q = vecPartials[p];
+					if (q.nType != OSC_NOISE)
+					{
+						sines(q, p, pTime, c0, c1, nLanes, block.nSampleRate, lanes);
+						continue;
+					}
+
+					// Noise comes a voice at a time, each from its own generator
+					for (unsigned int l = 0; l < nNotes; l++)
+					{
+						pNotes[l]->osc[p].rng.Fill(OSC_NOISE, lanes.dNoise, c1 - c0);
+						for (unsigned int f = c0; f < c1; f++)
+							pOut[f * LANES + l] += q.dLevel * lanes.dNoise[f - c0];
+					}
+				}
+
+				for (unsigned int l = 0; l < nNotes; l++)
+				{
+					if (lanes.bFinished[l])
+						continue;
+					for (unsigned int f = c0; f < c1; f++)
+					{
+						FTYPE dAmplitude = pAmplitude[f * LANES + l];
+						pOut[f * LANES + l] = dAmplitude * pOut[f * LANES + l] * dVolume;
+						if (bUntilSilent ? dAmplitude <= 0.0 : fMaxLifeTime > 0.0 && pTime[f] - pNotes[l]->on >= fMaxLifeTime)
+						{
+							lanes.nEnd[l] = f + 1;
+							lanes.bFinished[l] = true;
+							break;
+						}
+					}
+				}
+			}
+
+			// Back to the oscillators, for next time
+			for (unsigned int l = 0; l < nNotes; l++)
+				for (unsigned int p = 0; p < nPartials; p++)
+				{
+					oscillator &o = pNotes[l]->osc[p];
+					if (vecPartials[p].nType == OSC_NOISE)
+						continue;
+					o.dPhase = lanes.dPhase[p][l] - floor(lanes.dPhase[p][l]);
+					o.dLastTime = lanes.dLastTime[p][l];
+					o.dLFOCos = lanes.dLFOCos[p][l];
+					o.dLFOSin = lanes.dLFOSin[p][l];
+				}
+		}
+
+	private:
+		// Sine partial q, oscillator p of every lane, over frames f0 to f1 added
+		// into the lanes' sound. They move on, and fall silent above the Nyquist
+		// frequency, just as oscillator::sine() would.
+		void sines(const partial &q, unsigned int p, const FTYPE *pTime, unsigned int f0, unsigned int f1,
+			unsigned int nLanes, unsigned int nSampleRate, voice_lanes &lanes)
+		{
+			typedef olcVec S;
+			FTYPE *pOut = lanes.vecOut.data();
+			const FTYPE *pFrequency = lanes.vecFrequency.data();
+
+			// The LFO turns the same way every sample, as a sample is always as long
+			bool bLFO = q.dLFOAmplitude != 0.0;
+			FTYPE dTurn = q.dLFOHertz / (FTYPE)nSampleRate;
+			const S::V vStepCos = S::Set(olcCos2Pi(dTurn)), vStepSin = S::Set(olcSin2Pi(dTurn));
+			const S::V vDepth = S::Set(q.dLFOAmplitude * 0.5 / PI), vLevel = S::Set(q.dLevel);
+			const S::V vZero = S::Set(0.0), vHalf = S::Set(0.5), vOneHalf = S::Set(1.5);
+
+			for (unsigned int l0 = 0; l0 < nLanes; l0 += S::N)
+			{
+				S::V vPhase = S::Load(lanes.dPhase[p] + l0), vLast = S::Load(lanes.dLastTime[p] + l0);
+				S::V vOn = S::Load(lanes.dOn + l0), vHertz = S::Load(lanes.dHertz[p] + l0);
+				S::V vCos = S::Load(lanes.dLFOCos[p] + l0), vSin = S::Load(lanes.dLFOSin[p] + l0);
+				for (unsigned int f = f0; f < f1; f++)
+				{
+					S::V vTime = S::Sub(S::Set(pTime[f]), vOn);
+					S::V vStep = S::Sub(vTime, vLast);
+					vLast = vTime;
+
+					S::V vHertzNow = S::Mul(vHertz, S::Load(pFrequency + f * LANES + l0));
+					vPhase = S::Add(vPhase, S::Mul(vHertzNow, vStep));
+					vPhase = S::Sub(vPhase, S::Round(vPhase));
+
+					S::V vTurns = vPhase;
+					if (bLFO)
+					{
+						S::V c = S::Sub(S::Mul(vCos, vStepCos), S::Mul(vSin, vStepSin));
+						S::V s = S::Add(S::Mul(vSin, vStepCos), S::Mul(vCos, vStepSin));
+						S::V vFix = S::Sub(vOneHalf, S::Mul(vHalf, S::Add(S::Mul(c, c), S::Mul(s, s))));
+						S::M mMoved = S::Greater(vStep, vZero);	// Not on a voice's first sample
+						vCos = S::Select(mMoved, S::Mul(c, vFix), vCos);
+						vSin = S::Select(mMoved, S::Mul(s, vFix), vSin);
+						vTurns = S::Add(vPhase, S::Mul(vDepth, S::Mul(vHertzNow, vSin)));
+					}
+
+					S::V vSine, vCosine;
+					olcSinCos2PiKernel<S>(vTurns, vSine, vCosine);
+					vSine = S::Select(S::Less(S::Mul(vHertzNow, vStep), vHalf), vSine, vZero);
+					S::Store(pOut + f * LANES + l0, S::Add(S::Load(pOut + f * LANES + l0), S::Mul(vLevel, vSine)));
+				}
+				S::Store(lanes.dPhase[p] + l0, vPhase);
+				S::Store(lanes.dLastTime[p] + l0, vLast);
+				S::Store(lanes.dLFOCos[p] + l0, vCos);
+				S::Store(lanes.dLFOSin[p] + l0, vSin);
+			}
+		}
+	};
+
+	struct instrument_bell : public instrument_partials
+	{
+		instrument_bell()
+		{
+			env.dAttackTime = 0.01;
+			env.dDecayTime = 1.0;
+			env.dSustainAmplitude = 0.0;
+			env.dReleaseTime = 1.0;
+			fMaxLifeTime = 3.0;
+			dVolume = 1.0;
+			name = L"Bell";
+
+			vecPartials = {
+				{ synth::OSC_SINE, 1.00, 12, 5.0, 0.001 },
+				{ synth::OSC_SINE, 0.50, 24 },
+				{ synth::OSC_SINE, 0.25, 36 } };
+		}
+	};
+
+	struct instrument_bell8 : public instrument<instrument_bell8>
+	{
+		instrument_bell8()
+		{
+			env.dAttackTime = 0.01;
+			env.dDecayTime = 0.5;
+			env.dSustainAmplitude = 0.8;
+			env.dReleaseTime = 1.0;
+			fMaxLifeTime = 3.0;
+			dVolume = 1.0;
+			name = L"8-Bit Bell";
+		}
+
+		virtual FTYPE sound(const FTYPE dTime, synth::note &n, bool &bNoteFinished)
+		{
+			FTYPE dAmplitude = n.ctl.dAmplitude;
+			if (dAmplitude <= 0.0) bNoteFinished = true;
+
+			FTYPE dSound =
+				+1.00 * n.osc[0].play<synth::OSC_SQUARE>(dTime - n.on, synth::scale(n.id) * n.ctl.dFrequency, 5.0, 0.001)
+				+ 0.50 * n.osc[1].play<synth::OSC_SINE, false>(dTime - n.on, synth::scale(n.id + 12) * n.ctl.dFrequency)
+				+ 0.25 * n.osc[2].play<synth::OSC_SINE, false>(dTime - n.on, synth::scale(n.id + 24) * n.ctl.dFrequency);
+
+			return dAmplitude * dSound * dVolume;
+		}
+
+	};
+
+	struct instrument_harmonica : public instrument<instrument_harmonica>
+	{
+		instrument_harmonica()
+		{
+			env.dAttackTime = 0.00;
+			env.dDecayTime = 1.0;
+			env.dSustainAmplitude = 0.95;
+			env.dReleaseTime = 0.1;
+			fMaxLifeTime = -1.0;
+			name = L"Harmonica";
+			dVolume = 0.3;
+		}
+
+		virtual FTYPE sound(const FTYPE dTime, synth::note &n, bool &bNoteFinished)
+		{
+			FTYPE dAmplitude = n.ctl.dAmplitude;
+			if (dAmplitude <= 0.0) bNoteFinished = true;
+
+			FTYPE dSound =
+				+ 1.0  * n.osc[0].play<synth::OSC_SAW_ANA, true, 100>(n.on - dTime, synth::scale(n.id-12) * n.ctl.dFrequency, 5.0, 0.001)
+				+ 1.00 * n.osc[1].play<synth::OSC_SQUARE>(dTime - n.on, synth::scale(n.id) * n.ctl.dFrequency, 5.0, 0.001)
+				+ 0.50 * n.osc[2].play<synth::OSC_SQUARE, false>(dTime - n.on, synth::scale(n.id + 12) * n.ctl.dFrequency)
+				+ 0.05  * n.osc[3].play<synth::OSC_NOISE, false>(dTime - n.on, synth::scale(n.id + 24) * n.ctl.dFrequency);
+
+			return dAmplitude * dSound * dVolume;
+		}
+
+	};
+
+
+	struct instrument_drumkick : public instrument_partials
+	{
+		instrument_drumkick()
+		{
+			env.dAttackTime = 0.01;
+			env.dDecayTime = 0.15;
+			env.dSustainAmplitude = 0.0;
+			env.dReleaseTime = 0.0;
+			fMaxLifeTime = 1.5;
+			name = L"Drum Kick";
+			dVolume = 1.0;
+
+			bUntilSilent = false;
+			vecPartials = {
+				{ synth::OSC_SINE, 0.99, -36, 1.0, 1.0 },
+				{ synth::OSC_NOISE, 0.01 } };
+		}
+	};
+
+	struct instrument_drumsnare : public instrument_partials
+	{
+		instrument_drumsnare()
+		{
+			env.dAttackTime = 0.0;
+			env.dDecayTime = 0.2;
+			env.dSustainAmplitude = 0.0;
+			env.dReleaseTime = 0.0;
+			fMaxLifeTime = 1.0;
+			name = L"Drum Snare";
+			dVolume = 1.0;
+
+			bUntilSilent = false;
+			vecPartials = {
+				{ synth::OSC_SINE, 0.5, -24, 0.5, 1.0 },
+				{ synth::OSC_NOISE, 0.5 } };
+		}
+	};
+
+
+	struct instrument_drumhihat : public instrument<instrument_drumhihat>
+	{
+		instrument_drumhihat()
+		{
+			env.dAttackTime = 0.01;
+			env.dDecayTime = 0.05;
+			env.dSustainAmplitude = 0.0;
+			env.dReleaseTime = 0.0;
+			fMaxLifeTime = 1.0;
+			name = L"Drum HiHat";
+			dVolume = 0.5;
+		}
+
+		virtual FTYPE sound(const FTYPE dTime, synth::note &n, bool &bNoteFinished)
+		{
+			FTYPE dAmplitude = n.ctl.dAmplitude;
+			if (fMaxLifeTime > 0.0 && dTime - n.on >= fMaxLifeTime)	bNoteFinished = true;
+
+			FTYPE dSound =
+				+ 0.1 * n.osc[0].play<synth::OSC_SQUARE>(dTime - n.on, synth::scale(n.id -12) * n.ctl.dFrequency, 1.5, 1)
+				+ 0.9 * n.osc[1].play<synth::OSC_NOISE, false>(dTime - n.on, 0);
+
+			return dAmplitude * dSound * dVolume;
+		}
+
+	};
+
+
+	struct sequencer
+	{
+	public:
+		struct channel
+		{
+			instrument_base* instrument;
+			wstring sBeat;
+		};
+
+	public:
+		sequencer(float tempo = 120.0f, int beats = 4, int subbeats = 4)
+		{
+			nBeats = beats;
+			nSubBeats = subbeats;
+			fTempo = tempo;
+			fBeatTime = (60.0f / fTempo) / (float)nSubBeats;
+			nCurrentBeat = 0;
+			nTotalBeats = nSubBeats * nBeats;
+			nBeatCount = 0;
+		}
+
+		// Same tempo and pattern, back at the start
+		sequencer(const sequencer &s) : sequencer((float)s.fTempo, s.nBeats, s.nSubBeats)
+		{
+			fBeatTime = s.fBeatTime;
+			vecChannel = s.vecChannel;
+		}
+
+		// Move to nSample, as if every beat before it had been played
+		void Seek(uint64_t nSample, unsigned int nSampleRate)
+		{
+			FTYPE dBeatSamples = fBeatTime * (FTYPE)nSampleRate;
+			nBeatCount = (uint64_t)max<FTYPE>(0.0, floor((FTYPE)nSample / dBeatSamples) - 2.0);
+			while ((uint64_t)((FTYPE)(nBeatCount + 1) * dBeatSamples + 0.5) < nSample)
+				nBeatCount++;
+			nCurrentBeat = (int)(nBeatCount % nTotalBeats);
+			vecEvents.clear();
+		}
+
+
+		// Step the sequencer over the nFrames starting at nStartSample. Every beat
+		// that falls in that range makes note events stamped with the exact sample
+		// of the beat. Beats are placed from the start, so they never drift.
+		// No more than nMost events are made, a beat that would go over waits
+		// for the next call, still stamped with its own sample.
+		int Update(uint64_t nStartSample, unsigned int nFrames, unsigned int nSampleRate, size_t nMost = SIZE_MAX)
+		{
+			vecEvents.clear();
+
+			FTYPE dBeatSamples = fBeatTime * (FTYPE)nSampleRate;
+			while (true)
+			{
+				uint64_t nBeatSample = (uint64_t)((FTYPE)(nBeatCount + 1) * dBeatSamples + 0.5);
+				if (nBeatSample >= nStartSample + nFrames)
+					break;
+
+				int nNext = (int)((nCurrentBeat + 1) % nTotalBeats);
+				size_t nHits = 0;
+				for (auto &v : vecChannel)
+					if (v.sBeat[nNext] == L'X')
+						nHits++;
+				if (vecEvents.size() + nHits > nMost)
+					break;
+
+				nBeatCount++;
+				nCurrentBeat = (nCurrentBeat + 1) % nTotalBeats;
+
+				int c = 0;
+				for (auto &v : vecChannel)
+				{
+					if (v.sBeat[nCurrentBeat] == L'X')
+					{
+						note_event e;
+						e.nSample = nBeatSample;
+						e.bNoteOn = true;
+						e.bRetrigger = false;
+						e.n.channel = vecChannel[c].instrument;
+						e.n.active = true;
+						e.n.id = 64;
+						vecEvents.push_back(e);
+					}
+					c++;
+				}
+			}
+
+			return vecEvents.size();
+		}
+
+		void AddInstrument(instrument_base *inst)
+		{
+			channel c;
+			c.instrument = inst;
+			vecChannel.push_back(c);
+		}
+
+		public:
+		int nBeats;
+		int nSubBeats;
+		FTYPE fTempo;
+		FTYPE fBeatTime;
+		uint64_t nBeatCount;
+		atomic<int> nCurrentBeat; // Read by the UI while the sound thread plays
+		int nTotalBeats;
+
+	public:
+		vector<channel> vecChannel;
+		vector<note_event> vecEvents;
+		
+
+	private:
+	
+	};
+	
+}
+
+const unsigned int MAX_CHANNELS = 8;
+const unsigned int VOICES_PER_TASK = 4;
+const size_t MAX_EVENTS = 1024;	// Events a context holds waiting for their sample
+
+// Voices are mixed in groups, each group into its own buffer, spread over
+// the worker pool. The groups are then added together in order, so the result
+// is the same however many threads there are. Instruments that play voices in
+// lanes get groups of their own voices, up to synth::LANES of them, and the
+// rest are grouped VOICES_PER_TASK at a time.
+struct voice_task
+{
+	vector<FTYPE> vecMix;	// Channel after channel, a block's frames each
+	vector<FTYPE> vecVoice;	// One voice's sound for the block, before it is panned
+	vector<FTYPE> vecPan;	// Its pan modulation, for instruments that have any
+	synth::voice_lanes lanes;	// Or a group's sound, for instruments that play in lanes
+};
+
+struct voice_group
+{
+	unsigned int nFirst, nCount;	// In synth_context::vecOrder
+	bool bLanes;
+};
+
+// What to do with a new note when every voice is already sounding
+const int STEAL_OLDEST = 0;	// Take the voice that started longest ago
+const int STEAL_QUIETEST = 1;	// Take the voice with the lowest envelope
+const int STEAL_SAME_NOTE = 2;	// Always restart the same note on the same instrument if it is
+				// sounding, otherwise as STEAL_OLDEST
+const int STEAL_NONE = 3;	// Drop the new note
+
+const unsigned int NO_VOICE = UINT_MAX;	// The end of a chain of voices
+
+// The voices that can sound at once, all made up front. Free voices wait on
+// a list, so starting a note takes one off the end and finishing one puts it
+// back, and the notes themselves never move. The sounding voices are chained
+// together in the order they started, which is the order they are mixed in,
+// so a stolen voice comes out of the chain and goes on the end without
+// anything else moving. Voices are known by their place in the pool.
+//
+// Sounding voices are also hashed on their instrument and note id, each
+// bucket a chain of voices, so finding a key's voices does not mean looking
+// through them all. A key can have any number of voices at once, say one
+// held and others still releasing.
+struct voice_pool
+{
+	int nSteal = STEAL_OLDEST;
+
+	voice_pool(unsigned int nVoices = 64) { Create(nVoices); }
+
+	// Room for nVoices at once. Not while the voices are being played!
+	void Create(unsigned int nVoices)
+	{
+		vecVoices.assign(max(nVoices, 1u), synth::note());
+		vecNext.assign(vecVoices.size(), NO_VOICE);
+		vecPrev.assign(vecVoices.size(), NO_VOICE);
+		vecNewer.assign(vecVoices.size(), NO_VOICE);
+		vecOlder.assign(vecVoices.size(), NO_VOICE);
+		vecAge.assign(vecVoices.size(), 0);
+		size_t nBuckets = 1;
+		while (nBuckets < vecVoices.size() * 2)
+			nBuckets *= 2;
+		vecBucket.assign(nBuckets, NO_VOICE);
+		nStarted = 0;
+		nOldest = nNewest = NO_VOICE;
+		nSounding = 0;
+		vecFree.clear();
+		vecFree.reserve(vecVoices.size());
+		for (unsigned int i = (unsigned int)vecVoices.size(); i-- > 0;)
+			vecFree.push_back(i);
+	}
+
+	size_t size() const { return nSounding; }
+	size_t capacity() const { return vecVoices.size(); }
+	synth::note &operator[](unsigned int v) { return vecVoices[v]; }
+
+	// The sounding voices, oldest first: from Oldest(), Newer() each time
+	// until NO_VOICE
+	unsigned int Oldest() const { return nOldest; }
+	unsigned int Newer(unsigned int v) const { return vecNewer[v]; }
+
+	// The oldest sounding voice playing note nId on instrument pChannel, or
+	// with bHeld the oldest whose key is still down
+	synth::note *Find(int nId, const synth::instrument_base *pChannel, bool bHeld = false)
+	{
+		unsigned int nFound = NO_VOICE;
+		for (unsigned int v = vecBucket[Bucket(nId, pChannel)]; v != NO_VOICE; v = vecNext[v])
+		{
+			const synth::note &n = vecVoices[v];
+			if (n.id != nId || n.channel != pChannel || (bHeld && !(n.on > n.off)))
+				continue;
+			if (nFound == NO_VOICE || vecAge[v] < vecAge[nFound])
+				nFound = v;
+		}
+		return nFound == NO_VOICE ? nullptr : &vecVoices[nFound];
+	}
+
+	// A voice to play n on, copied in but not yet started, or nullptr if
+	// none could be had
+	synth::note *Start(const synth::note &n)
+	{
+		unsigned int nVoice = NO_VOICE;
+		if (nSteal == STEAL_SAME_NOTE)
+		{
+			synth::note *pSame = Find(n.id, n.channel);
+			if (pSame != nullptr)
+				nVoice = (unsigned int)(pSame - vecVoices.data());
+		}
+
+		if (nVoice == NO_VOICE && vecFree.empty())
+		{
+			if (nSteal == STEAL_NONE || nOldest == NO_VOICE)
+				return nullptr;
+			nVoice = nSteal == STEAL_QUIETEST ? Quietest() : nOldest;
+		}
+
+		if (nVoice != NO_VOICE)
+			Remove(nVoice);
+		else
+		{
+			nVoice = vecFree.back();
+			vecFree.pop_back();
+		}
+
+		// On the end, it is the newest note now
+		vecVoices[nVoice] = n;
+		vecAge[nVoice] = nStarted++;
+		vecOlder[nVoice] = nNewest;
+		vecNewer[nVoice] = NO_VOICE;
+		if (nNewest != NO_VOICE)
+			vecNewer[nNewest] = nVoice;
+		else
+			nOldest = nVoice;
+		nNewest = nVoice;
+		nSounding++;
+		Link(nVoice);
+		return &vecVoices[nVoice];
+	}
+
+	// Free the voices that have finished, in one pass
+	void Collect()
+	{
+		for (unsigned int v = nOldest; v != NO_VOICE;)
+		{
+			unsigned int nNext = vecNewer[v];
+			if (!vecVoices[v].active)
+			{
+				Remove(v);
+				vecFree.push_back(v);
+			}
+			v = nNext;
+		}
+	}
+
+	void clear()
+	{
+		while (nOldest != NO_VOICE)
+		{
+			vecFree.push_back(nOldest);
+			Remove(nOldest);
+		}
+	}
+
+private:
+	vector<synth::note> vecVoices;
+	vector<unsigned int> vecFree;	// Voices waiting to be used
+	vector<unsigned int> vecNewer;	// The sounding voices either side in start order
+	vector<unsigned int> vecOlder;
+	unsigned int nOldest = NO_VOICE, nNewest = NO_VOICE;
+	size_t nSounding = 0;
+
+	vector<unsigned int> vecBucket;	// First voice in each bucket
+	vector<unsigned int> vecNext;	// The voices either side in the same bucket
+	vector<unsigned int> vecPrev;
+	vector<uint64_t> vecAge;	// When each voice started, in voices started
+	uint64_t nStarted = 0;
+
+	size_t Bucket(int nId, const synth::instrument_base *pChannel) const
 	{
-	public:
-		struct channel
+		uint64_t nChannel = (uint64_t)(uintptr_t)pChannel;
+		uint32_t nHash = olcHash32((uint32_t)nId ^ olcHash32((uint32_t)nChannel ^ (uint32_t)(nChannel >> 32)));
+		return nHash & (vecBucket.size() - 1);
+	}
+
+	void Link(unsigned int v)
+	{
+		size_t b = Bucket(vecVoices[v].id, vecVoices[v].channel);
+		vecPrev[v] = NO_VOICE;
+		vecNext[v] = vecBucket[b];
+		if (vecBucket[b] != NO_VOICE)
+			vecPrev[vecBucket[b]] = v;
+		vecBucket[b] = v;
+	}
+
+	void Unlink(unsigned int v)
+	{
+		if (vecPrev[v] != NO_VOICE)
+			vecNext[vecPrev[v]] = vecNext[v];
+		else
+			vecBucket[Bucket(vecVoices[v].id, vecVoices[v].channel)] = vecNext[v];
+		if (vecNext[v] != NO_VOICE)
+			vecPrev[vecNext[v]] = vecPrev[v];
+		vecNext[v] = vecPrev[v] = NO_VOICE;
+	}
+
+	// Takes a sounding voice out of its bucket and out of the start order
+	void Remove(unsigned int v)
+	{
+		Unlink(v);
+		if (vecOlder[v] != NO_VOICE)
+			vecNewer[vecOlder[v]] = vecNewer[v];
+		else
+			nOldest = vecNewer[v];
+		if (vecNewer[v] != NO_VOICE)
+			vecOlder[vecNewer[v]] = vecOlder[v];
+		else
+			nNewest = vecOlder[v];
+		vecNewer[v] = vecOlder[v] = NO_VOICE;
+		nSounding--;
+	}
+
+	// The sounding voice with the lowest envelope, the oldest if several are
+	// as quiet. Notes not yet past their attack count as at their peak.
+	unsigned int Quietest() const
+	{
+		unsigned int nQuietest = nOldest;
+		FTYPE dQuietest = INFINITY;
+		for (unsigned int v = nOldest; v != NO_VOICE; v = vecNewer[v])
 		{
-			instrument_base* instrument;
-			wstring sBeat;
-		};
+			const synth::note &n = vecVoices[v];
+			FTYPE dLevel = n.ctl.eg.dLevel;
+			if (n.ctl.eg.nStage <= synth::ENV_ATTACK && n.channel != nullptr)
+				dLevel = n.channel->env.dStartAmplitude;
+			if (dLevel * n.gain < dQuietest)
+			{
+				dQuietest = dLevel * n.gain;
+				nQuietest = v;
+			}
+		}
+		return nQuietest;
+	}
+};
 
-	public:
-		sequencer(float tempo = 120.0f, int beats = 4, int subbeats = 4)
+// Work out how much of a voice each channel gets. Pan runs from -1.0 (first
+// channel) to +1.0 (last channel), with a constant power law between the two
+// channels either side of the pan position.
+void PanGains(FTYPE dPan, FTYPE dGain, unsigned int nChannels, FTYPE *pGains)
+{
+	for (unsigned int c = 0; c < nChannels; c++)
+		pGains[c] = 0.0;
+
+	if (nChannels == 1)
+	{
+		pGains[0] = dGain;
+		return;
+	}
+
+	FTYPE dPos = (fmin(fmax(dPan, -1.0), 1.0) + 1.0) * 0.5 * (FTYPE)(nChannels - 1);
+	unsigned int c = min((unsigned int)dPos, nChannels - 2);
+	FTYPE dFrac = dPos - (FTYPE)c;
+	pGains[c] = dGain * cos(dFrac * PI * 0.5);
+	pGains[c + 1] = dGain * sin(dFrac * PI * 0.5);
+}
+
+// Everything that changes as the music plays: the sounding notes, the events
+// waiting to happen and the sequencer's place. One of these plays live, and
+// offline renders can make as many as they like to render pieces side by side.
+struct synth_context : public olcRenderContext
+{
+	voice_pool voices;
+	vector<unsigned int> vecOrder;	// The sounding voices, group after group, by their place in the pool
+	vector<voice_group> vecGroups;
+	vector<char> vecGrouped;
+	vector<synth::note_event> vecEvents;
+	olcMPSCQueue<synth::note_event> queEvents;	// Posted from other threads, see Post()
+	vector<voice_task> vecTasks;
+	vector<FTYPE> vecTime;
+	synth::sequencer seq;
+	olcWorkerPool *pPool = nullptr;	// Helps mix the voices, if there is one
+
+	synth_context() : seq(90.0)
+	{
+		Create();
+	}
+
+	synth_context(const synth::sequencer &pattern, unsigned int nVoices, int nSteal) : voices(nVoices), seq(pattern)
+	{
+		voices.nSteal = nSteal;
+		Create();
+	}
+
+	// Room for nVoices at once. Not while it is playing!
+	void Polyphony(unsigned int nVoices)
+	{
+		voices.Create(nVoices);
+		Create();
+	}
+
+	// Hands an event to whichever thread renders, from any thread. The voices
+	// belong to that thread alone, it picks the events up at its next block.
+	// Fails if too many are waiting, try again later.
+	bool Post(const synth::note_event &e)
+	{
+		return queEvents.Push(e);
+	}
+
+	// Start again from nSample, as if the music had been playing until then
+	void Seek(uint64_t nSample, unsigned int nSampleRate) override
+	{
+		voices.clear();
+		vecEvents.clear();
+		seq.Seek(nSample, nSampleRate);
+	}
+
+	// Sequencer notes all end by themselves, this is how long the longest lasts
+	FTYPE MaxNoteLength() const
+	{
+		FTYPE dLength = 0.0;
+		for (auto &c : seq.vecChannel)
 		{
-			nBeats = beats;
-			nSubBeats = subbeats;
-			fTempo = tempo;
-			fBeatTime = (60.0f / fTempo) / (float)nSubBeats;
-			nCurrentBeat = 0;
-			nTotalBeats = nSubBeats * nBeats;
-			fAccumulate = 0;
+			if (c.instrument->fMaxLifeTime <= 0.0)
+				return -1.0;
+			dLength = max(dLength, c.instrument->fMaxLifeTime);
+		}
+		return dLength;
+	}
+
+	// The whole block is filled with amplitudes (-1.0 to +1.0). The block is
+	// split at each event so notes start and stop on the exact sample they
+	// were stamped with.
+	void Render(olcNoiseBlock &block) override
+	{
+		for (unsigned int f = 0; f < block.nFrames; f++)
+			for (unsigned int c = 0; c < block.nChannels; c++)
+				block.at(f, c) = 0.0;
+
+		// Posted events, then the sequencer (generates notes, note offs applied by note lifespan).
+		// Neither list grows past MAX_EVENTS, the room they were reserved: the
+		// sequencer's beats that do not fit are made next block, and posted
+		// events that do not fit wait in the queue. The sequencer has first claim.
+		size_t nSorted = vecEvents.size();
+		seq.Update(block.nStartSample, block.nFrames, block.nSampleRate, MAX_EVENTS - nSorted);
+		size_t nRoom = MAX_EVENTS - nSorted - seq.vecEvents.size();
+		synth::note_event e;
+		while (nRoom > 0 && queEvents.Pop(e))
+		{
+			vecEvents.push_back(e);
+			nRoom--;
+		}
+		vecEvents.insert(vecEvents.end(), seq.vecEvents.begin(), seq.vecEvents.end());
+
+		// Those left from before are in order already, an insertion sort puts
+		// the new ones among them without allocating, same times in the order they came
+		for (size_t i = nSorted; i < vecEvents.size(); i++)
+		{
+			e = vecEvents[i];
+			size_t j = i;
+			for (; j > 0 && vecEvents[j - 1].nSample > e.nSample; j--)
+				vecEvents[j] = vecEvents[j - 1];
+			vecEvents[j] = e;
+		}
+
+		uint64_t nEndSample = block.nStartSample + block.nFrames;
+		unsigned int f = 0;
+		size_t nApplied = 0;
+		for (; nApplied < vecEvents.size() && vecEvents[nApplied].nSample < nEndSample; nApplied++)
+		{
+			const synth::note_event &e = vecEvents[nApplied];
+			unsigned int nAt = e.nSample > block.nStartSample ? (unsigned int)(e.nSample - block.nStartSample) : 0;
+			MixNotes(block, f, nAt);
+			ApplyEvent(e, block.Time(nAt));
+			f = nAt;
 		}
+		MixNotes(block, f, block.nFrames);
+		vecEvents.erase(vecEvents.begin(), vecEvents.begin() + nApplied);
+
+		block.nVoices = (unsigned int)voices.size();
+
+		// Remove notes which are now inactive
+		voices.Collect();
+	}
+
+private:
+	void Create()
+	{
+		queEvents.Create(256);
+		vecEvents.reserve(MAX_EVENTS);
+		seq.vecEvents.reserve(MAX_EVENTS);
+		vecOrder.reserve(voices.capacity());
+		vecGroups.reserve(voices.capacity());
+		vecGrouped.reserve(voices.capacity());
+	}
+
+	// Sorts the sounding voices into groups. Voices that play alone keep the
+	// order they started in, then each instrument that plays in lanes gets
+	// its voices grouped together, in the order it first appears.
+	void Group()
+	{
+		vecOrder.clear();
+		vecGroups.clear();
+		vecGrouped.assign(voices.capacity(), 0);
+
+		auto add = [this](unsigned int v, bool bLanes, unsigned int nMost)
+		{
+			if (vecGroups.empty() || vecGroups.back().bLanes != bLanes || vecGroups.back().nCount == nMost
+				|| (bLanes && voices[vecOrder[vecGroups.back().nFirst]].channel != voices[v].channel))
+				vecGroups.push_back({ (unsigned int)vecOrder.size(), 0, bLanes });
+			vecOrder.push_back(v);
+			vecGroups.back().nCount++;
+			vecGrouped[v] = 1;
+		};
 
+		// Those that have finished, or have nothing to play, are left out
+		for (unsigned int v = voices.Oldest(); v != NO_VOICE; v = voices.Newer(v))
+			if (!voices[v].active || voices[v].channel == nullptr)
+				vecGrouped[v] = 1;
+			else if (!voices[v].channel->lanes())
+				add(v, false, VOICES_PER_TASK);
 
-		int Update(FTYPE fElapsedTime)
+		for (unsigned int v = voices.Oldest(); v != NO_VOICE; v = voices.Newer(v))
 		{
-			vecNotes.clear();
+			if (vecGrouped[v])
+				continue;
+			for (unsigned int w = v; w != NO_VOICE; w = voices.Newer(w))
+				if (!vecGrouped[w] && voices[w].channel == voices[v].channel)
+					add(w, true, synth::LANES);
+		}
+
+		// A voice on its own is quicker played the usual way
+		for (auto &g : vecGroups)
+			if (g.nCount == 1)
+				g.bLanes = false;
+	}
+
+public:
+	// The part of the block being mixed, handed to each voice task
+	struct mix_job
+	{
+		synth_context *ctx;
+		olcNoiseBlock *block;
+		unsigned int f0, f1;
+		const FTYPE *pTime;	// Time of each frame in the block
+	};
+
+	// Mix one group of notes into frames f0 up to (not including) f1 of the task's
+	// own buffer. Each note is worked out once per frame, then shared out between
+	// the channels.
+	static void MixTask(void *pUser, unsigned int nTask)
+	{
+		mix_job &job = *(mix_job*)pUser;
+		synth_context &ctx = *job.ctx;
+		const voice_group &group = ctx.vecGroups[nTask];
+		voice_task &task = ctx.vecTasks[nTask];
+		unsigned int nFrames = job.block->nFrames;
+		unsigned int nChannels = min(job.block->nChannels, MAX_CHANNELS);
 
-			fAccumulate += fElapsedTime;
-			while(fAccumulate >= fBeatTime)
+		for (unsigned int c = 0; c < nChannels; c++)
+			fill(task.vecMix.begin() + c * nFrames + job.f0, task.vecMix.begin() + c * nFrames + job.f1, 0.0);
+
+		if (group.bLanes)
+		{
+			// The whole group at once, then each lane mixed like any other voice
+			synth::note *pNotes[synth::LANES];
+			for (unsigned int l = 0; l < group.nCount; l++)
+				pNotes[l] = &ctx.voices[ctx.vecOrder[group.nFirst + l]];
+			synth::instrument_base *pChannel = pNotes[0]->channel;
+			pChannel->sound_lanes(*job.block, job.pTime, job.f0, job.f1, pNotes, group.nCount, task.lanes);
+
+			bool bPan = pChannel->mod.Sends(synth::MOD_PAN);
+			for (unsigned int l = 0; l < group.nCount; l++)
 			{
-				fAccumulate -= fBeatTime;
-				nCurrentBeat++;
+				MixVoice(task, *pNotes[l], task.lanes.vecOut.data() + l, bPan ? task.lanes.vecPan.data() + l : nullptr,
+					synth::LANES, nFrames, nChannels, job.f0, task.lanes.nEnd[l]);
+				if (task.lanes.bFinished[l])
+					pNotes[l]->active = false;
+			}
+			return;
+		}
 
-				if (nCurrentBeat >= nTotalBeats)
-					nCurrentBeat = 0;
+		for (unsigned int i = group.nFirst; i < group.nFirst + group.nCount; i++)
+		{
+			synth::note &n = ctx.voices[ctx.vecOrder[i]];
+			if (n.channel == nullptr || !n.active)
+				continue;
+
+			// Get samples for this note by using the correct instrument and envelope
+			bool bNoteFinished = false;
+			bool bPan = n.channel->mod.Sends(synth::MOD_PAN);
+			unsigned int fEnd = n.channel->sound_block(*job.block, job.pTime, job.f0, job.f1, n,
+				task.vecVoice.data(), bPan ? task.vecPan.data() : nullptr, bNoteFinished);
+			if (bNoteFinished) // Flag note to be removed, it has no more to say
+				n.active = false;
+
+			MixVoice(task, n, task.vecVoice.data(), bPan ? task.vecPan.data() : nullptr, 1, nFrames, nChannels, job.f0, fEnd);
+		}
+	}
 
-				int c = 0;
-				for (auto v : vecChannel)
-				{
-					if (v.sBeat[nCurrentBeat] == L'X')
-					{
-						note n;
-						n.channel = vecChannel[c].instrument;
-						n.active = true;
-						n.id = 64;
-						vecNotes.push_back(n);
-					}
-					c++;
-				}
+	// Mix frames f0 up to fEnd of one voice into the group's buffer. Its frames
+	// are nStride apart in pVoice, and in pPan, if its pan moves.
+	static void MixVoice(voice_task &task, const synth::note &n, const FTYPE *pVoice, const FTYPE *pPan,
+		unsigned int nStride, unsigned int nFrames, unsigned int nChannels, unsigned int f0, unsigned int fEnd)
+	{
+		FTYPE dGains[MAX_CHANNELS];
+		if (pPan)
+		{
+			// The pan moves, so the share each channel gets does too
+			for (unsigned int f = f0; f < fEnd; f++)
+			{
+				PanGains(n.pan + n.channel->dPan + pPan[f * nStride], n.gain * 0.2, nChannels, dGains);
+				for (unsigned int c = 0; c < nChannels; c++)
+					task.vecMix[c * nFrames + f] += dGains[c] * pVoice[f * nStride];
 			}
+			return;
+		}
 
-			
+		PanGains(n.pan + n.channel->dPan, n.gain * 0.2, nChannels, dGains);
+		for (unsigned int c = 0; c < nChannels; c++)
+		{
+			if (dGains[c] == 0.0)
+				continue;
+			FTYPE *pMix = task.vecMix.data() + c * nFrames;
+			for (unsigned int f = f0; f < fEnd; f++)
+				pMix[f] += dGains[c] * pVoice[f * nStride];
+		}
+	}
 
-			return vecNotes.size();
+	// Mix all active notes into frames f0 up to (not including) f1 of the block
+	void MixNotes(olcNoiseBlock &block, unsigned int f0, unsigned int f1)
+	{
+		unsigned int nChannels = min(block.nChannels, MAX_CHANNELS);
+		Group();
+		unsigned int nTasks = (unsigned int)vecGroups.size();
+		if (vecTasks.size() < nTasks)
+			vecTasks.resize(nTasks);
+		for (unsigned int t = 0; t < nTasks; t++)
+		{
+			if (vecTasks[t].vecVoice.size() < block.nFrames)
+			{
+				vecTasks[t].vecVoice.resize(block.nFrames);
+				vecTasks[t].vecPan.resize(block.nFrames);
+			}
+			if (vecTasks[t].vecMix.size() < block.nFrames * nChannels)
+				vecTasks[t].vecMix.resize(block.nFrames * nChannels);
 		}
 
-		void AddInstrument(instrument_base *inst)
+		if (vecTime.size() < block.nFrames)
+			vecTime.resize(block.nFrames);
+		for (unsigned int f = f0; f < f1; f++)
+			vecTime[f] = block.Time(f);
+
+		mix_job job = { this, &block, f0, f1, vecTime.data() };
+		if (pPool != nullptr)
+			pPool->Run(nTasks, MixTask, &job);
+		else
+			for (unsigned int t = 0; t < nTasks; t++)
+				MixTask(&job, t);
+
+		// Add the groups up, always in the same order
+		for (unsigned int t = 0; t < nTasks; t++)
+			for (unsigned int c = 0; c < nChannels; c++)
+			{
+				const FTYPE *pMix = vecTasks[t].vecMix.data() + c * block.nFrames;
+				for (unsigned int f = f0; f < f1; f++)
+					block.at(f, c) += pMix[f];
+			}
+	}
+
+	// Switch a note on or off, at the time of the sample the event was stamped with
+	void ApplyEvent(const synth::note_event &e, FTYPE dTime)
+	{
+		if (e.nParam != synth::PARAM_NONE)
 		{
-			channel c;
-			c.instrument = inst;
-			vecChannel.push_back(c);
+			if (e.n.channel == nullptr)
+				return;
+			if (e.nParam == synth::PARAM_VOLUME)
+				e.n.channel->dVolume = e.dValue;
+			if (e.nParam == synth::PARAM_PAN)
+				e.n.channel->dPan = e.dValue;
+			return;
 		}
 
-		public:
-		int nBeats;
-		int nSubBeats;
-		FTYPE fTempo;
-		FTYPE fBeatTime;
-		FTYPE fAccumulate;
-		int nCurrentBeat;
-		int nTotalBeats;
+		// A key let go releases its held voice, even if an older one of the
+		// same note is still dying away
+		synth::note *noteFound = nullptr;
+		if (!e.bNoteOn || e.bRetrigger)
+			noteFound = voices.Find(e.n.id, e.n.channel, !e.bNoteOn);
 
-	public:
-		vector<channel> vecChannel;
-		vector<note> vecNotes;
-		
+		if (e.bNoteOn)
+		{
+			// The noise depends only on when, what and which instrument, so
+			// is the same however the piece is rendered
+			uint32_t nSeed = olcHash32((uint32_t)e.nSample ^ olcHash32((uint32_t)(e.nSample >> 32) ^ olcHash32((uint32_t)e.n.id)));
+			if (e.n.channel != nullptr)
+				nSeed ^= (uint32_t)hash<wstring>()(e.n.channel->name);
 
-	private:
-	
-	};
-	
-}
+			if (noteFound == nullptr)
+			{
+				// Start a new note, on a free voice or one taken from another note
+				synth::note *n = voices.Start(e.n);
+				if (n != nullptr)
+				{
+					n->on = dTime;
+					n->active = true;
+					n->start(nSeed);
+				}
+			}
+			else if (noteFound->off > noteFound->on)
+			{
+				// Key has been pressed again during release phase
+				noteFound->on = dTime;
+				noteFound->active = true;
+				noteFound->start(nSeed);
+			}
+		}
+		else if (noteFound != nullptr && noteFound->off < noteFound->on)
+		{
+			// Key has been released, so switch off, and start the release now
+			// rather than at the end of the control period
+			noteFound->off = dTime;
+			noteFound->ctl.nEnd = 0;
+		}
+	}
+};
 
-vector<synth::note> vecNotes;
-mutex muxNotes;
 synth::instrument_bell instBell;
 synth::instrument_harmonica instHarm;
 synth::instrument_drumkick instKick;
 synth::instrument_drumsnare instSnare;
 synth::instrument_drumhihat instHiHat;
+olcWorkerPool pool;
+synth_context live;	// What is playing, the keyboard posts its events here
 
-typedef bool(*lambda)(synth::note const& item);
-template<class T>
-void safe_remove(T &v, lambda f)
+// Function used by olcNoiseMaker to generate sound waves. Only the sound
+// thread touches the notes, so nothing needs locking.
+void MakeNoise(olcNoiseBlock &block)
 {
-	auto n = v.begin();
-	while (n != v.end())
-		if (!f(*n))
-			n = v.erase(n);
-		else
-			++n;
+	live.Render(block);
 }
 
-// Function used by olcNoiseMaker to generate sound waves
-// Returns amplitude (-1.0 to +1.0) as a function of time
-FTYPE MakeNoise(int nChannel, FTYPE dTime)
-{	
-	unique_lock<mutex> lm(muxNotes);
-	FTYPE dMixedOutput = 0.0;
+// Offline renders make a fresh context for each piece, with the live one's pattern
+olcRenderContext *CreateContext(void * /*pUser*/)
+{
+	return new synth_context(live.seq, (unsigned int)live.voices.capacity(), live.voices.nSteal);
+}
 
-	// Iterate through all active notes, and mix together
-	for (auto &n : vecNotes)
+// Render the sequencer to a .wav file as fast as possible, no sound card needed.
+// With more than one thread the piece is cut up and the parts rendered side by
+// side, which gives exactly the same file.
+int RenderOffline(const string &sFilename, FTYPE dDuration, const string &sFormat, unsigned int nThreads)
+{
+	olcSampleFormat nFormat = OLC_SAMPLE_PCM16;
+	if (sFormat == "24") nFormat = OLC_SAMPLE_PCM24;
+	if (sFormat == "32") nFormat = OLC_SAMPLE_PCM32;
+	if (sFormat == "float") nFormat = OLC_SAMPLE_FLOAT32;
+
+	olcNoiseMaker<short> sound;
+	sound.CreateOffline(44100, 2, 8192);
+	sound.SetUserBlockFunction(MakeNoise);
+
+	auto tp1 = chrono::high_resolution_clock::now();
+	bool bOk;
+	if (nThreads > 1 && live.MaxNoteLength() >= 0.0)
+		bOk = sound.RenderToFileParallel(sFilename, dDuration, nFormat, CreateContext, nullptr, live.MaxNoteLength(), nThreads);
+	else
+		bOk = sound.RenderToFile(sFilename, dDuration, nFormat);
+	FTYPE dRenderTime = chrono::duration<FTYPE>(chrono::high_resolution_clock::now() - tp1).count();
+
+	if (!bOk)
 	{
-		bool bNoteFinished = false;
-		FTYPE dSound = 0;
+		wcout << "Failed to write " << sFilename.c_str() << endl;
+		return 1;
+	}
 
-		// Get sample for this note by using the correct instrument and envelope
-		if(n.channel != nullptr)
-			dSound = n.channel->sound(dTime, n, bNoteFinished);
-		
-		// Mix into output
-		dMixedOutput += dSound;
+	wcout << "Rendered " << dDuration << "s to " << sFilename.c_str() << " in " << dRenderTime << "s ("
+		<< dDuration / dRenderTime << "x real time)" << endl;
+	return 0;
+}
+
+// Play the sequencer with no UI, e.g. to the "null" device to see if
+// rendering keeps up with real time on a machine with no sound card
+int PlayHeadless(const wstring &sDevice, FTYPE dDuration, const string &sStatsFile, const olcRealtimeProfile &rt)
+{
+	olcNoiseMaker<short> sound;
+	sound.SetRealtimeProfile(rt);
+	sound.SetUserBlockFunction(MakeNoise);
+	sound.Create(sDevice, 44100, 2, 8, 512);
+	if (!sound.IsReady())
+	{
+		wcerr << "Could not open device " << sDevice << endl;
+		return 1;
+	}
+	wcerr << sound.GetRealtimeReport().Text().c_str();
+	if (!sStatsFile.empty())
+		sound.StartStatsDump(sStatsFile);
+
+	auto tp1 = chrono::high_resolution_clock::now();
+	this_thread::sleep_for(chrono::duration<FTYPE>(dDuration));
+	FTYPE dWallTime = chrono::duration<FTYPE>(chrono::high_resolution_clock::now() - tp1).count();
+	FTYPE dTimeNow = sound.GetTime();
+	sound.Stop();
+
+	wcerr << "Wall Time: " << dWallTime << " CPU Time: " << dTimeNow << " Latency: " << dTimeNow - dWallTime
+		<< " Queue: " << sound.GetQueueDepth() << " blocks (" << sound.GetLatency() * 1000.0 << "ms)" << endl;
+	wcerr << sound.GetStats().Text().c_str() << endl;
+	return 0;
+}
+
+// How long a waveform takes a sample, and how loud its aliasing is next to
+// the harmonics it should have. The test tone fits a whole number of cycles
+// into one second, at a prime frequency, so anything folded back from above
+// the Nyquist frequency lands between the harmonics and can be told apart.
+// Timed loops add their results into dBenchSink so they are not optimised away.
+static volatile FTYPE dBenchSink = 0.0;
+
+template<typename F>
+void BenchWave(const wchar_t *sName, F fWave)
+{
+	const int nRate = 44100;
+	const FTYPE dHertz = 3001.0;
+	const FTYPE dStep = dHertz / (FTYPE)nRate;
+
+	vector<FTYPE> vecTone(nRate);
+	FTYPE dPhase = 0.0;
+	for (auto &d : vecTone)
+	{
+		d = fWave(dPhase, dStep);
+		dPhase += dStep;
+		dPhase -= floor(dPhase);
+	}
 
-		if (bNoteFinished) // Flag note to be removed
-			n.active = false;
+	FTYPE dMean = 0.0, dTotal = 0.0, dHarmonics = 0.0;
+	for (auto d : vecTone) { dMean += d; dTotal += d * d; }
+	dMean /= (FTYPE)nRate;
+	dTotal = dTotal / (FTYPE)nRate - dMean * dMean;
+	for (FTYPE h = 1.0; h * dHertz < nRate / 2; h++)
+	{
+		FTYPE re = 0.0, im = 0.0;
+		for (int i = 0; i < nRate; i++)
+		{
+			FTYPE a = 2.0 * PI * h * dHertz * (FTYPE)i / (FTYPE)nRate;
+			re += vecTone[i] * cos(a);
+			im += vecTone[i] * sin(a);
+		}
+		dHarmonics += 2.0 * (re * re + im * im) / ((FTYPE)nRate * (FTYPE)nRate);
+	}
+	FTYPE dAlias = fmax(dTotal - dHarmonics, 1e-30);
+
+	// Timed at a lower note, the way most of them are played
+	const int nSamples = 10000000;
+	FTYPE dSum = 0.0, dSlow = 440.0 / (FTYPE)nRate;
+	dPhase = 0.0;
+	auto tp1 = chrono::high_resolution_clock::now();
+	for (int i = 0; i < nSamples; i++)
+	{
+		dSum += fWave(dPhase, dSlow);
+		dPhase += dSlow;
+		dPhase -= floor(dPhase);
 	}
-	// Woah! Modern C++ Overload!!! Remove notes which are now inactive
-	safe_remove<vector<synth::note>>(vecNotes, [](synth::note const& item) { return item.active; });
-	return dMixedOutput * 0.2;
+	FTYPE dTime = chrono::duration<FTYPE>(chrono::high_resolution_clock::now() - tp1).count();
+	dBenchSink = dBenchSink + dSum;
+
+	wcout << "  " << setw(10) << left << sName << right << setw(8) << fixed << setprecision(1) << dTime * 1e9 / nSamples << "ns"
+		<< setw(10) << 10.0 * log10(dAlias / dHarmonics) << "dB" << endl;
 }
 
-int main()
+// main4 -bench-osc, compares the ways of making each waveform
+int BenchOscillators()
 {
-	
+	synth::tables();
+
+	const int nTypes[] = { synth::OSC_SQUARE, synth::OSC_TRIANGLE, synth::OSC_SAW_DIG };
+	const wchar_t *sTypes[] = { L"Square", L"Triangle", L"Saw (digital)" };
+
+	// Sine through libm one at a time, against the vector maths over blocks
+	{
+		const int nBlock = 512, nBlocks = 20000;
+		vector<FTYPE> vecPhase(nBlock), vecOut(nBlock);
+		FTYPE dLibm = 0.0, dVector = 0.0, dError = 0.0, dSum = 0.0;
+		for (int b = 0; b < nBlocks; b++)
+		{
+			for (int i = 0; i < nBlock; i++)
+				vecPhase[i] = 440.0 * (FTYPE)(b * nBlock + i) / 44100.0;
+
+			auto tp1 = chrono::high_resolution_clock::now();
+			for (int i = 0; i < nBlock; i++)
+				vecOut[i] = sin(2.0 * PI * vecPhase[i]);
+			auto tp2 = chrono::high_resolution_clock::now();
+			dSum += vecOut[b % nBlock];
+			olcSin2Pi(vecPhase.data(), vecPhase.data(), nBlock);
+			auto tp3 = chrono::high_resolution_clock::now();
+
+			dLibm += chrono::duration<FTYPE>(tp2 - tp1).count();
+			dVector += chrono::duration<FTYPE>(tp3 - tp2).count();
+			for (int i = 0; i < nBlock; i++)
+				dError = fmax(dError, fabs(vecPhase[i] - vecOut[i]));
+		}
+		dBenchSink = dBenchSink + dSum;
+
+		FTYPE dSamples = (FTYPE)nBlock * (FTYPE)nBlocks;
+		wcout << "Sine, " << olcVec::N << " at a time" << endl
+			<< "  " << setw(10) << left << L"libm" << right << setw(8) << fixed << setprecision(1) << dLibm * 1e9 / dSamples << "ns" << endl
+			<< "  " << setw(10) << left << L"vector" << right << setw(8) << dVector * 1e9 / dSamples << "ns"
+			<< "  largest difference " << scientific << setprecision(2) << dError << endl;
+	}
+
+	wcout << "Per sample cost, and aliasing against the harmonics of a " << 3001 << "Hz tone" << endl;
+	for (int t = 0; t < 3; t++)
+	{
+		int nType = nTypes[t];
+		wcout << sTypes[t] << endl;
+
+		BenchWave(L"maths", [nType](FTYPE p, FTYPE /*dt*/) { return synth::wave(nType, p, 0.0, 50.0, 0.0); });
+
+		const synth::wavetable *table = synth::tables().Get(nType);
+		if (table != nullptr)
+			BenchWave(L"table", [table](FTYPE p, FTYPE dt)
+			{
+				int nLevel;
+				FTYPE dFade;
+				synth::wavetable::Level(log2(synth::wavetable::SIZE * dt) + 1.0, nLevel, dFade);
+				return table->Sample(p, nLevel, dFade);
+			});
+
+		BenchWave(L"polyblep", [nType](FTYPE p, FTYPE dt) { return synth::wave_blep(nType, p, dt); });
+	}
+
+	// Bell voices one at a time, against a group of them in lanes
+	{
+		const unsigned int nVoices = 64, nBlock = 512, nBlocks = 80;
+		vector<synth::note> vecOne(nVoices);
+		for (unsigned int v = 0; v < nVoices; v++)
+		{
+			synth::note &n = vecOne[v];
+			n.id = 48 + v % 24;
+			n.channel = &instBell;
+			n.active = true;
+			n.off = -1.0;	// Held down
+			n.start(v);
+		}
+		vector<synth::note> vecLanes = vecOne;
+
+		olcNoiseBlock block = {};
+		block.nFrames = nBlock;
+		block.nChannels = 1;
+		block.nSampleRate = 44100;
+		vector<FTYPE> vecTime(nBlock), vecOut(nBlock), vecFirst(nBlock);
+		synth::voice_lanes lanes;
+		FTYPE dOne = 0.0, dLanes = 0.0, dError = 0.0;
+		for (unsigned int b = 0; b < nBlocks; b++)
+		{
+			block.nStartSample = (uint64_t)b * nBlock;
+			for (unsigned int f = 0; f < nBlock; f++)
+				vecTime[f] = block.Time(f);
+
+			auto tp1 = chrono::high_resolution_clock::now();
+			for (unsigned int v = 0; v < nVoices; v++)
+			{
+				bool bFinished = false;
+				instBell.sound_block(block, vecTime.data(), 0, nBlock, vecOne[v], v == 0 ? vecFirst.data() : vecOut.data(), nullptr, bFinished);
+			}
+			auto tp2 = chrono::high_resolution_clock::now();
+			for (unsigned int v = 0; v < nVoices; v += synth::LANES)
+			{
+				synth::note *pNotes[synth::LANES];
+				for (unsigned int l = 0; l < synth::LANES; l++)
+					pNotes[l] = &vecLanes[v + l];
+				instBell.sound_lanes(block, vecTime.data(), 0, nBlock, pNotes, synth::LANES, lanes);
+				if (v == 0)
+					for (unsigned int f = 0; f < nBlock; f++)
+						dError = fmax(dError, fabs(lanes.vecOut[f * synth::LANES] - vecFirst[f]));
+			}
+			auto tp3 = chrono::high_resolution_clock::now();
+
+			dOne += chrono::duration<FTYPE>(tp2 - tp1).count();
+			dLanes += chrono::duration<FTYPE>(tp3 - tp2).count();
+		}
+
+		FTYPE dSamples = (FTYPE)nBlock * (FTYPE)nBlocks * (FTYPE)nVoices;
+		wcout << "Bell, per voice per sample with " << nVoices << " sounding" << endl
+			<< "  " << setw(10) << left << L"one" << right << setw(8) << fixed << setprecision(1) << dOne * 1e9 / dSamples << "ns" << endl
+			<< "  " << setw(10) << left << L"lanes" << right << setw(8) << dLanes * 1e9 / dSamples << "ns"
+			<< "  largest difference " << scientific << setprecision(2) << dError << endl;
+	}
+	return 0;
+}
 
-	// Shameless self-promotion
-	wcout << "www.OneLoneCoder.com - Synthesizer Part 4" << endl 
+int main(int argc, char *argv[])
+{
+	// Shameless self-promotion, on stderr as stdout may be carrying sound
+	wcerr << "www.OneLoneCoder.com - Synthesizer Part 4" << endl 
 		  << "Multiple FM Oscillators, Sequencing, Polyphony" << endl << endl;
 
+	// Establish Sequencer
+	instSnare.dPan = -0.3;
+	instHiHat.dPan = 0.4;
+	live.seq.AddInstrument(&instKick);
+	live.seq.AddInstrument(&instSnare);
+	live.seq.AddInstrument(&instHiHat);
+
+	live.seq.vecChannel.at(0).sBeat = L"X...X...X..X.X..";
+	live.seq.vecChannel.at(1).sBeat = L"..X...X...X...X.";
+	live.seq.vecChannel.at(2).sBeat = L"X.X.X.X.X.X.X.XX";
+
 	// Get all sound hardware
 	vector<wstring> devices = olcNoiseMaker<short>::Enumerate();
 
+	// -rt anywhere runs the render thread with a real-time profile,
+	// -threads <n> sets how many extra threads help mix the voices, and
+	// -tuning <just|equal|file.scl> with -kbm <file.kbm> picks the tuning,
+	// and -voices <n> with -steal <oldest|quietest|same|none> sets the polyphony
+	olcRealtimeProfile rt;
+	int nThreads = (int)thread::hardware_concurrency() - 1;
+	string sTuning, sKeyboardMap;
+	for (int a = 1; a < argc; a++)
+	{
+		int nTake = 0;
+		if (string(argv[a]) == "-rt")
+		{
+			rt.bEnabled = true;
+			nTake = 1;
+		}
+		else if (string(argv[a]) == "-threads" && a + 1 < argc)
+		{
+			nThreads = atoi(argv[a + 1]);
+			nTake = 2;
+		}
+		else if (string(argv[a]) == "-tuning" && a + 1 < argc)
+		{
+			sTuning = argv[a + 1];
+			nTake = 2;
+		}
+		else if (string(argv[a]) == "-kbm" && a + 1 < argc)
+		{
+			sKeyboardMap = argv[a + 1];
+			nTake = 2;
+		}
+		else if (string(argv[a]) == "-voices" && a + 1 < argc)
+		{
+			live.Polyphony((unsigned int)max(atoi(argv[a + 1]), 1));
+			nTake = 2;
+		}
+		else if (string(argv[a]) == "-steal" && a + 1 < argc)
+		{
+			string sSteal = argv[a + 1];
+			live.voices.nSteal = sSteal == "quietest" ? STEAL_QUIETEST : sSteal == "same" ? STEAL_SAME_NOTE : sSteal == "none" ? STEAL_NONE : STEAL_OLDEST;
+			nTake = 2;
+		}
+		if (nTake == 0)
+			continue;
+		for (int b = a; b + nTake <= argc; b++) argv[b] = argv[b + nTake];
+		argc -= nTake;
+		a--;
+	}
+	// Make the wavetables now, rather than on the first note
+	synth::tables();
+
+	if (sTuning == "just")
+		synth::set_tuning(synth::tuning::Just());
+	else if (sTuning == "equal")
+		synth::set_tuning(synth::tuning::Equal());
+	else if (!sTuning.empty())
+	{
+		synth::tuning t;
+		if (!t.LoadScala(sTuning, sKeyboardMap))
+		{
+			wcerr << "Could not load tuning " << sTuning.c_str() << endl;
+			return 1;
+		}
+		synth::set_tuning(t);
+	}
+
+	pool.Create((unsigned int)max(nThreads, 0), rt);
+	live.pPool = &pool;
+
+	// main4 -render out.wav [seconds] [16|24|32|float]
+	if (argc >= 3 && string(argv[1]) == "-render")
+		return RenderOffline(argv[2], argc >= 4 ? atof(argv[3]) : 30.0, argc >= 5 ? argv[4] : "16", (unsigned int)max(nThreads, 0) + 1);
+
+	// main4 -play <device> [seconds] [stats.csv]
+	if (argc >= 3 && string(argv[1]) == "-play")
+		return PlayHeadless(wstring(argv[2], argv[2] + strlen(argv[2])), argc >= 4 ? atof(argv[3]) : 10.0, argc >= 5 ? argv[4] : "", rt);
+
+	// main4 -bench-osc
+	if (argc >= 2 && string(argv[1]) == "-bench-osc")
+		return BenchOscillators();
+
+	// main4 -devices
+	if (argc >= 2 && string(argv[1]) == "-devices")
+	{
+		for (auto d : devices) wcout << "Found Output Device: " << d << endl;
+		return 0;
+	}
+
+#ifndef _WIN32
+	wcout << "Usage: " << argv[0] << " [-threads n] -render out.wav [seconds] [16|24|32|float]" << endl
+		<< "       " << argv[0] << " [-rt] [-threads n] -play <device> [seconds] [stats.csv]" << endl
+		<< "       " << argv[0] << " -bench-osc" << endl
+		<< "       " << argv[0] << " -devices" << endl
+		<< "Any of them also take -tuning just|equal|file.scl [-kbm file.kbm]" << endl
+		<< "and -voices n [-steal oldest|quietest|same|none]" << endl;
+	return 1;
+#else
+
 	// Create sound machine!!
-	olcNoiseMaker<short> sound(devices[0], 44100, 1, 8, 256);
+	olcNoiseMaker<short> sound;
+	sound.SetRealtimeProfile(rt);
 
-	// Link noise function with sound machine
-	sound.SetUserFunction(MakeNoise);
+	// Link noise function with sound machine, before it starts asking for sound
+	sound.SetUserBlockFunction(MakeNoise);
+	sound.Create(devices[0], 44100, 2, 8, 512);
 
 	// Create Screen Buffer
 	wchar_t *screen = new wchar_t[80 * 30];
@@ -575,16 +2885,7 @@ int main()
 	auto clock_real_time = chrono::high_resolution_clock::now();
 	double dElapsedTime = 0.0;
 	double dWallTime = 0.0;
-
-	// Establish Sequencer
-	synth::sequencer seq(90.0);
-	seq.AddInstrument(&instKick);
-	seq.AddInstrument(&instSnare);
-	seq.AddInstrument(&instHiHat);
-
-	seq.vecChannel.at(0).sBeat = L"X...X...X..X.X..";
-	seq.vecChannel.at(1).sBeat = L"..X...X...X...X.";
-	seq.vecChannel.at(2).sBeat = L"X.X.X.X.X.X.X.XX";
+	bool bKeyHeld[16] = { false };
 
 	while (1)
 	{
@@ -598,61 +2899,26 @@ int main()
 		dWallTime += dElapsedTime;
 		FTYPE dTimeNow = sound.GetTime();
 
-		// Sequencer (generates notes, note offs applied by note lifespan) ======================================
-		int newNotes = seq.Update(dElapsedTime);
-		muxNotes.lock();
-		for (int a = 0; a < newNotes; a++)
-		{
-			seq.vecNotes[a].on = dTimeNow;
-			vecNotes.emplace_back(seq.vecNotes[a]);
-		}
-		muxNotes.unlock();
-
-		// Keyboard (generates and removes notes depending on key state) ========================================
+		// Keyboard (generates note events when key state changes) =============================================
+		uint64_t nEventSample = sound.GetEventSample();
 		for (int k = 0; k < 16; k++)
 		{
 			short nKeyState = GetAsyncKeyState((unsigned char)("ZSXCFVGBNJMK\xbcL\xbe\xbf"[k]));
-				
-			// Check if note already exists in currently playing notes
-			muxNotes.lock();
-			auto noteFound = find_if(vecNotes.begin(), vecNotes.end(), [&k](synth::note const& item) { return item.id == k+64 && item.channel == &instHarm; });
-			if (noteFound == vecNotes.end())
-			{
-				// Note not found in vector
-				if (nKeyState & 0x8000)
-				{
-					// Key has been pressed so create a new note
-					synth::note n;
-					n.id = k + 64;
-					n.on = dTimeNow;
-					n.active = true;
-					n.channel = &instHarm;
-
-					// Add note to vector
-					vecNotes.emplace_back(n);
-				}
-			}
-			else
-			{
-				// Note exists in vector
-				if (nKeyState & 0x8000)
-				{
-					// Key is still held, so do nothing
-					if (noteFound->off > noteFound->on)
-					{
-						// Key has been pressed again during release phase
-						noteFound->on = dTimeNow;
-						noteFound->active = true;
-					}
-				}
-				else
-				{
-					// Key has been released, so switch off
-					if (noteFound->off < noteFound->on)
-						noteFound->off = dTimeNow;
-				}
-			}
-			muxNotes.unlock();		
+			bool bHeld = (nKeyState & 0x8000) != 0;
+			if (bHeld == bKeyHeld[k])
+				continue;
+
+			// Key has been pressed or released, the sound thread finds the note
+			synth::note_event e;
+			e.nSample = nEventSample;
+			e.bNoteOn = bHeld;
+			e.bRetrigger = true;
+			e.n.id = k + 64;
+			e.n.channel = &instHarm;
+			e.n.pan = ((FTYPE)k - 7.5) / 30.0; // Spread the keyboard a little, low notes on the left
+
+			if (live.Post(e)) // Or try again next time round
+				bKeyHeld[k] = bHeld;
 		}
 
 		// --- VISUAL STUFF ---
@@ -662,16 +2928,16 @@ int main()
 
 		// Draw Sequencer
 		draw(2, 2, L"SEQUENCER:");
-		for (int beats = 0; beats < seq.nBeats; beats++)
+		for (int beats = 0; beats < live.seq.nBeats; beats++)
 		{
-			draw(beats*seq.nSubBeats + 20, 2, L"O");
-			for (int subbeats = 1; subbeats < seq.nSubBeats; subbeats++)
-				draw(beats*seq.nSubBeats + subbeats + 20, 2, L".");
+			draw(beats*live.seq.nSubBeats + 20, 2, L"O");
+			for (int subbeats = 1; subbeats < live.seq.nSubBeats; subbeats++)
+				draw(beats*live.seq.nSubBeats + subbeats + 20, 2, L".");
 		}
 
 		// Draw Sequences
 		int n = 0;
-		for (auto v : seq.vecChannel)
+		for (auto v : live.seq.vecChannel)
 		{
 			draw(2, 3 + n, v.instrument->name);
 			draw(20, 3 + n, v.sBeat);
@@ -679,7 +2945,7 @@ int main()
 		}
 
 		// Draw Beat Cursor
-		draw(20 + seq.nCurrentBeat, 1, L"|");
+		draw(20 + live.seq.nCurrentBeat, 1, L"|");
 
 		// Draw Keyboard
 		draw(2, 8,  L"|   |   |   |   |   | |   |   |   |   | |   | |   |   |   |  ");
@@ -690,8 +2956,12 @@ int main()
 		draw(2, 13, L"|_____|_____|_____|_____|_____|_____|_____|_____|_____|_____|");
 
 		// Draw Stats
-		wstring stats =  L"Notes: " + to_wstring(vecNotes.size()) + L" Wall Time: " + to_wstring(dWallTime) + L" CPU Time: " + to_wstring(dTimeNow) + L" Latency: " + to_wstring(dWallTime - dTimeNow) ;
+		wstring stats =  L"Notes: " + to_wstring(sound.GetStats().nVoices) + L" Wall Time: " + to_wstring(dWallTime) + L" CPU Time: " + to_wstring(dTimeNow) + L" Latency: " + to_wstring(dWallTime - dTimeNow) ;
 		draw(2, 15, stats);
+		stats = L"Queue: " + to_wstring(sound.GetQueueDepth()) + L" blocks (" + to_wstring(sound.GetLatency() * 1000.0) + L"ms)";
+		draw(2, 16, stats);
+		string sEngine = sound.GetStats().Text();
+		draw(2, 17, wstring(sEngine.begin(), sEngine.end()).substr(0, 76));
 
 		// Update Display
 		WriteConsoleOutputCharacter(hConsole, screen, 80 * 30, { 0,0 }, &dwBytesWritten);
@@ -699,4 +2969,5 @@ int main()
 
 
 	return 0;
+#endif
 }